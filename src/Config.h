@@ -3,10 +3,15 @@
 #define OPT_CONFIG_H
 
 #include <array>
+#include <atomic>
 #include <memory>
+#include <new>
 #include <vector>
 #include <set>
 #include <map>
+#include <unordered_map>
+#include <unordered_set>
+#include <variant>
 #include <queue>
 #include <functional>
 #include <optional>
@@ -40,8 +45,12 @@ using DeviceId = uint64_t;
 
 constexpr DocId StorageInfoDocId = 1;
 
-// Current version for data serialization
-constexpr int SerializationFormatVersion = 1;
+// Current version for data serialization.
+// Version 2 writes every tranzaction of the storage as a record with its length and creation time.
+constexpr int SerializationFormatVersion = 2;
+
+// Version of the document manifest of LocalDocumentStorage
+constexpr int ManifestFormatVersion = 1;
 
 // Error codes
 constexpr int DuplicatedObjectName = 993;
@@ -54,10 +63,12 @@ constexpr int DuplicatedPropertyId = 999;
 constexpr int NotImplemented = 1000;
 constexpr int NoUndoRedoData = 225;
 constexpr int SelfInsertedDocument = 228;
+constexpr int PartialDocumentChange = 226;
 
 constexpr int SerializationFormatError = 229;
 constexpr int SerializationInternalError = 230;
 constexpr int SerializationFileOpenError = 231; 
+constexpr int SerializationChecksumError = 232;
 
 
 
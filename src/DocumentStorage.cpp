@@ -2,36 +2,274 @@
 #include "DocumentStorage.h"
 #include "TranzactionStorage.h"
 #include "ObjectStorage.h"
+#include "Serialize.h"
 
 
-vector<DocId> LocalDocumentStorage::list() const 
+DocumentInfo::DocumentInfo(Reader & r)
 {
-  vector<DocId> docIds;
-  for (const auto& entry : filesystem::directory_iterator(dir_))
+  r.getArray(5);
+  r.load(docId_);
+  r.load(size_);
+  r.load(latest_);
+  r.load(title_);
+  size_t size = r.getArray();
+  tags_.reserve(size);
+  while (size--)
+    tags_.push_back(r.getStr());
+}
+
+void DocumentInfo::write(Writer & w) const
+{
+  w.putArray(5);
+  w.save(docId_);
+  w.save(size_);
+  w.save(latest_);
+  w.putStr(title_);
+  w.putArray(tags_.size());
+  for (const string & tag : tags_)
+    w.putStr(tag);
+}
+
+
+string DocStorageInfo::title() const
+{
+  const TitleProp * prop = findProp<TitleProp>();
+  return prop ? prop->value() : string();
+}
+
+vector<string> DocStorageInfo::tags() const
+{
+  vector<string> tags;
+  if (const TagsProp * prop = findProp<TagsProp>())
   {
-    if (entry.is_regular_file())
+    const string & value = prop->value();
+    for (size_t begin = 0; begin < value.size(); )
     {
-      string fname = entry.path().filename().string();
-      auto id = strtoll(fname.c_str(), nullptr, 16);
-      if (0 < id && id < 0x7fff'ffff'ffff'ffff) // overfow procection
-        docIds.push_back(static_cast<DocId>(id));
+      size_t end = value.find(',', begin);
+      if (end == string::npos)
+        end = value.size();
+      if (end > begin)
+        tags.push_back(value.substr(begin, end - begin));
+      begin = end + 1;
     }
   }
+  return tags;
+}
+
+
+vector<DocId> LocalDocumentStorage::list() const 
+{
+  vector<DocId> docIds;
+  docIds.reserve(manifest().size());
+  for (const auto & it : manifest())
+    docIds.push_back(it.first);
   return docIds;
 }
 
+vector<DocumentInfo> LocalDocumentStorage::documents() const
+{
+  vector<DocumentInfo> docs;
+  docs.reserve(manifest().size());
+  for (const auto & it : manifest())
+    docs.push_back(it.second);
+  return docs;
+}
+
+bool LocalDocumentStorage::documentInfo(DocId docId, DocumentInfo & info) const
+{
+  auto it = manifest().find(docId);
+  if (it == manifest().end())
+    return false;
+  info = it->second;
+  return true;
+}
+
+LocalDocumentStorage::~LocalDocumentStorage()
+{
+  while (!files_.empty())
+    (*files_.begin())->detach();
+}
+
 TranzactionStorage * LocalDocumentStorage::open(DocId docId, TrzFilter filter) 
 {
-  char str[24];
-  sprintf(str, "%lx", docId);
-  return new LocalDocumentFile(dir_ / str, filter);
+  return new LocalDocumentFile(documentPath(docId), filter, flags_, this);
 }
 
 void LocalDocumentStorage::remove(DocId docId) 
+{
+  filesystem::remove(documentPath(docId));
+  if (manifest().erase(docId))
+    appendManifest(nullptr, docId);
+}
+
+void LocalDocumentStorage::update(const DocumentInfo & info)
+{
+  manifest()[info.docId_] = info;
+  appendManifest(&info, 0);
+}
+
+filesystem::path LocalDocumentStorage::documentPath(DocId docId) const
 {
   char str[24];
   sprintf(str, "%lx", docId);
-  filesystem::remove(dir_ / str);
+  return dir_ / str;
+}
+
+map<DocId, DocumentInfo> & LocalDocumentStorage::manifest() const
+{
+  if (!manifest_ || manifestChanged())
+  {
+    if (!loadManifest())
+    {
+      scanDirectory();
+      writeManifest();
+    }
+  }
+  return *manifest_;
+}
+
+bool LocalDocumentStorage::manifestChanged() const
+{
+  error_code ec;
+  const uintmax_t size = filesystem::file_size(manifestPath(), ec);
+  if (ec)
+    return true;
+  const filesystem::file_time_type time = filesystem::last_write_time(manifestPath(), ec);
+  return ec || size != manifestSize_ || time != manifestTime_;
+}
+
+void LocalDocumentStorage::manifestStored() const
+{
+  error_code ec;
+  manifestSize_ = filesystem::file_size(manifestPath(), ec);
+  manifestTime_ = filesystem::last_write_time(manifestPath(), ec);
+}
+
+// Manifest file is [version, info...] with checksum followed by appended records with checksums:
+// array is added or changed document info, integer is removed document id
+bool LocalDocumentStorage::loadManifest() const
+{
+  manifest_.reset(new map<DocId, DocumentInfo>);
+  manifestRecords_ = 0;
+  manifestTorn_ = false;
+  if (!filesystem::exists(manifestPath()))
+    return false;
+
+  bool baseLoaded = false;
+  try
+  {
+    CborFileReader r(manifestPath());
+    size_t size = r.getArray();
+    if (size == 0 || r.getInt() != ManifestFormatVersion)
+      return false;
+    while (--size)
+    {
+      DocumentInfo info(r);
+      (*manifest_)[info.docId_] = move(info);
+    }
+    r.checkChecksum();
+    baseLoaded = true;
+
+    while (!r.atEnd())
+    {
+      if (r.isInt())
+      {
+        const DocId removed = r.getInt<DocId>();
+        r.checkChecksum();
+        manifest_->erase(removed);
+      }
+      else
+      {
+        DocumentInfo info(r);
+        r.checkChecksum();
+        (*manifest_)[info.docId_] = move(info);
+      }
+      manifestRecords_++;
+    }
+  }
+  catch (const exception&)
+  {
+    if (!baseLoaded)
+      return false;
+    manifestTorn_ = true; // interrupted append, the next change rewrites the manifest
+  }
+  manifestStored();
+  return true;
+}
+
+// Slow path when the manifest is missing, every document is opened to get its title
+void LocalDocumentStorage::scanDirectory() const
+{
+  manifest_.reset(new map<DocId, DocumentInfo>);
+  for (const auto& entry : filesystem::directory_iterator(dir_))
+  {
+    if (!entry.is_regular_file())
+      continue;
+    string fname = entry.path().filename().string();
+    char * end;
+    auto id = strtoll(fname.c_str(), &end, 16);
+    if (*end || id <= 0 || id >= 0x7fff'ffff'ffff'ffff) // not a document file or overfow
+      continue;
+
+    DocumentInfo info;
+    info.docId_ = static_cast<DocId>(id);
+    info.size_ = entry.file_size();
+    try
+    {
+      LocalDocumentFile file(entry.path(), TrzFilter::DocInfo);
+      TrzHub hub(info.docId_);
+      TopObjectStorage doc;
+      hub.connect(&doc);
+      hub.connect(&file);
+      info.latest_ = hub.latest();
+      hub.documentInfo(info);
+    }
+    catch (const exception&)
+    {
+      // damaged document is listed without its title
+    }
+    (*manifest_)[info.docId_] = move(info);
+  }
+}
+
+void LocalDocumentStorage::writeManifest() const
+{
+  const filesystem::path temp = dir_ / "~manifest";
+  {
+    CborFileWriter w(temp, false, true);
+    w.putArray(manifest_->size() + 1);
+    w.putInt(ManifestFormatVersion);
+    for (const auto & it : *manifest_)
+      it.second.write(w);
+    w.putChecksum();
+    w.flush();
+  }
+  filesystem::rename(temp, manifestPath());
+  if (flags_ & dfSyncWrites)
+    CborFileWriter::syncDirectory(dir_);
+  manifestRecords_ = 0;
+  manifestTorn_ = false;
+  manifestStored();
+}
+
+// The change is already in manifest_
+void LocalDocumentStorage::appendManifest(const DocumentInfo * info, DocId removed)
+{
+  if (manifestTorn_ || manifestRecords_ >= manifest_->size() + ManifestCompactLimit)
+  {
+    writeManifest();
+    return;
+  }
+
+  CborFileWriter w(manifestPath(), true, flags_ & dfSyncWrites);
+  if (info)
+    info->write(w);
+  else
+    w.save(removed);
+  w.putChecksum();
+  w.flush();
+  manifestRecords_++;
+  manifestStored();
 }
 
 
@@ -40,12 +278,14 @@ void DocumentStorage::addStandardTypes()
   Property::addPropertyDefinition<DocIdProp>("docId", READONLY | NO_DELETE);
   Property::addPropertyDefinition<UserIdProp>("userId", READONLY | NO_DELETE);
   Property::addPropertyDefinition<DocVariantProp>("docVariant", NO_DELETE);
+  Property::addPropertyDefinition<TitleProp>("title", 0);
+  Property::addPropertyDefinition<TagsProp>("tags", 0);
 
 
   UnifiedObject::addObjectDefinition<InsertedDocument> ("insert", 0);
-  UnifiedObject::addObjectDefinition<TopDocumentObject>("document", TOPOBJECT);
+  UnifiedObject::addObjectDefinition<TopDocumentObject>("document", TOPOBJECT | DOCINFO);
   UnifiedObject::addObjectDefinition<UserProfile>      ("user", TOPOBJECT);
   UnifiedObject::addObjectDefinition<InvitedUser>      ("invitedUser", 0);
-  UnifiedObject::addObjectDefinition<DocStorageInfo>   ("documents", 0);
+  UnifiedObject::addObjectDefinition<DocStorageInfo>   ("documents", DOCINFO);
 }
 
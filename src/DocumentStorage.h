@@ -7,6 +7,21 @@
 
 #include "Tranzaction.h"
 class TranzactionStorage;
+class LocalDocumentFile;
+
+// Document metadata kept by the storage, so it is available without opening the document
+struct DocumentInfo
+{
+  DocId docId_ = 0;
+  uintmax_t size_ = 0;     // file size in bytes
+  datetime_t latest_ = 0;  // creation time of the latest tranzaction
+  string title_;
+  vector<string> tags_;
+
+  DocumentInfo() = default;
+  explicit DocumentInfo(Reader&);
+  void write(Writer&) const;
+};
 
 class DocumentStorage
 {
@@ -33,7 +48,11 @@ public:
 
 class DocStorageInfo : public UnifiedObjectTempl<241>
 {
-  string title_;
+public:
+  string title() const;
+  vector<string> tags() const;
+
+private:
   string comment_;
 
   bool multiUser() const;
@@ -42,21 +61,55 @@ class DocStorageInfo : public UnifiedObjectTempl<241>
 
   bool forPrivateProfile() const;
 
-
-  vector<string> tags_;  
 };
 
 class LocalDocumentStorage : public DocumentStorage
 {
 public:
-  LocalDocumentStorage(const filesystem::path& dir) : dir_(dir) { }
+  // flags are DOC_FILE_FLAGS for all opened documents
+  LocalDocumentStorage(const filesystem::path& dir, int flags = 0) : dir_(dir), flags_(flags) { }
+  // Files still opened are detached, their appended changes are written to the manifest
+  ~LocalDocumentStorage();
 
   vector<DocId> list() const override;
   [[nodiscard]] TranzactionStorage * open(DocId, TrzFilter) override;
   void remove(DocId) override;
 
+  // Metadata of all documents from the manifest file, the documents are not opened
+  vector<DocumentInfo> documents() const;
+  bool documentInfo(DocId, DocumentInfo&) const;
+
+  // Document was saved, called by LocalDocumentFile
+  void update(const DocumentInfo&);
+
+  // The manifest is rewritten when it has more appended records than documents plus the limit
+  static constexpr size_t ManifestCompactLimit = 1000;
+
 protected:
   const filesystem::path dir_;
+  const int flags_;
+
+  // Manifest is loaded on the first access. If the file is missing or damaged, it is rebuilt by
+  // the directory scan. Changes are appended to the file as records with checksums.
+  // The file is reloaded when its size or time differ, it may be changed by another storage of the directory.
+  mutable unique_ptr<map<DocId, DocumentInfo>> manifest_;
+  mutable size_t manifestRecords_ = 0;
+  mutable bool manifestTorn_ = false;
+  mutable uintmax_t manifestSize_ = 0;
+  mutable filesystem::file_time_type manifestTime_;
+  bool manifestChanged() const;
+  void manifestStored() const;
+
+  map<DocId, DocumentInfo> & manifest() const;
+  bool loadManifest() const;
+  void scanDirectory() const;
+  void writeManifest() const;
+  void appendManifest(const DocumentInfo*, DocId removed);
+  filesystem::path manifestPath() const { return dir_ / "manifest"; }
+  filesystem::path documentPath(DocId) const;
+
+  friend class LocalDocumentFile;
+  set<LocalDocumentFile*> files_;
 };
 
 class RemoteDocumentStorage : public DocumentStorage
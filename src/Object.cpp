@@ -1,90 +1,129 @@
 ﻿
 #include "Object.h"
 #include "ObjectStorage.h"
+#include "Tranzaction.h"
 
 DefinitionRegistry<UnifiedObject::Definition> UnifiedObject::objDefs_;
 
-// Delete this object,
-// called вызывается при применении транзакции
-bool UnifiedObject::changeRemove()
+// Delete this object, called when a tranzaction is applied.
+// Objects linking to it by not deletable properties are deleted too, other linking objects lose the
+// link properties. The whole closure is collected first, so links to deleted objects are dropped at once
+// instead of being searched and erased one by one.
+bool UnifiedObject::changeRemove(TrzUndo* undo)
 {
-  if (0 == (state_ & osDeleted)) 
+  if (state_ & osDeleted)
+    return false;
+
+  vector<UnifiedObject*> deleted;
+  vector<Link> stripped; // remaining objects and their properties linking to deleted ones
+  const auto remove = [&](UnifiedObject* obj)
   {
-    while (!linked_.empty())
+    if (undo)
+      undo->keepDeleted(*obj);
+    obj->setState((obj->state_ & ~osActive) | osDeleted);
+    deleted.push_back(obj);
+  };
+
+  remove(this);
+  for (size_t i = 0; i < deleted.size(); i++)
+    for (const Link& link : deleted[i]->linked_)
     {
-      const auto& lobj = linked_.front();
-      const PropType pt = lobj.first;
-      const bool deletable = Property::propDefs_.get(pt).deletable();
-      const bool result = deletable ? lobj.second->changeRemove(pt) : lobj.second->changeRemove();
-      if (!result)
-        throw ErrorCode(1267);
-      lobj.second->state_ |= osParentDeleted;
+      UnifiedObject* owner = link.second;
+      owner->markChanged(osParentDeleted);
+      if (owner->state_ & osDeleted)
+        continue;
+      if (Property::propDefs_.get(link.first).deletable())
+        stripped.push_back(link);
+      else
+        remove(owner);
     }
-    for (PropPtr p : props_)
-      p->removeFrom(this);
-    props_.clear();
-    state_ = (state_ & 0x7fff) | osDeleted; 
-    return true;
+  ObjectStorage::removeFromTypeIndexes(deleted);
+  if (storage_)
+    storage_->linksChanged();
+
+  // Deleted objects aren't found by links anymore, so removing properties doesn't touch their links
+  for (const Link& link : stripped)
+    if (!(link.second->state_ & osDeleted))
+      if (!link.second->changeRemove(link.first, undo))
+        throw ErrorCode(1267);
+
+  for (UnifiedObject* obj : deleted)
+  {
+    if (!obj->linked_.empty())
+      obj->markChanged(osDelLink);
+    obj->linked_.clear();
+    obj->linkedSorted_ = 0;
+    for (const PropSlot& p : obj->props_)
+      obj->takeProp(*p.second);
+    obj->props_.clear();
   }
-  return false;
+  return true;
 }
 
-bool UnifiedObject::changeRemove(PropType pt)
+bool UnifiedObject::changeRemove(PropType pt, TrzUndo* undo)
 {
-  auto it = findPropIterator(pt);
-  if (it != props_.end() && (*it)->type() == pt)
+  const size_t i = findPropIndex(pt);
+  if (hasPropAt(i, pt))
   {
-    if (!(*it)->def().deletable())
+    const PropPtr& p = props_[i].second;
+    if (!p->def().deletable())
       throw ErrorCode(1257);
-    (*it)->removeFrom(this);
-    props_.erase(it);
-    state_ |= osDelProp;
+    if (undo)
+      undo->keepProp(*this, pt, p);
+    takeProp(*p);
+    props_.erase(props_.begin() + i);
+    markChanged(osDelProp);
     return true;
   }
   return false;
 }
 
 
-void UnifiedObject::change(const ObjectChanges& chgs)
+void UnifiedObject::change(const ObjectChanges& chgs, TrzUndo* undo)
 {
   if (chgs.objType() == ObjTypeDeleted) 
   {
-    changeRemove();
+    changeRemove(undo);
     return;
   }
   for (const PropPtr value : chgs.props()) 
   {
-    auto it = findPropIterator(value->type());
-    if (it != props_.end() && (*it)->type() == value->type())
+    const PropType pt = value->type();
+    const size_t i = findPropIndex(pt);
+    if (hasPropAt(i, pt))
     { 
-      if ((*it)->def().readonly())
+      PropPtr& p = props_[i].second;
+      if (p->def().readonly())
         throw ErrorCode(1238);
-      (*it)->removeFrom(this);
-      *it = value;
-      value->putInto(this);
-      state_ |= osChgProp;
+      if (undo)
+        undo->keepProp(*this, pt, p);
+      takeProp(*p);
+      p = value;
+      putProp(*value);
+      markChanged(osChgProp);
     }
     else
     { 
-      props_.push_back(value);
-      resortProps_ = true;
-      value->putInto(this);
-      state_ |= osAddProp;
+      if (undo)
+        undo->keepProp(*this, pt, nullptr);
+      appendProp(value);
+      putProp(*value);
+      markChanged(osAddProp);
     }
   }
   for (const PropType pt : chgs.del()) 
   {
-    changeRemove(pt);
+    changeRemove(pt, undo);
   }
   for (const auto& link : linked_)
-    link.second->state_ |= osParentChanged;
+    link.second->markChanged(osParentChanged);
 }
 
 
 string UnifiedObject::debugString() const
 {
   string str;
-  for (const PropPtr& p : props_)
+  for (const PropPtr& p : props())
   {
     str += to_string(int(p->type()));
     str += ":";
@@ -93,13 +132,99 @@ string UnifiedObject::debugString() const
       p->write(jw);
       str += jw.data();
     }
-    if (props_.back() != p)
+    if (props_.back().second != p)
       str += ',';
   }
   return str;
 }
 
 
+// Owners are ordered by their long names, so the order doesn't depend on addresses of the objects
+static bool linkLess(const pair<PropType, UnifiedObject*>& a, const pair<PropType, UnifiedObject*>& b)
+{
+  if (a.first != b.first)
+    return a.first < b.first;
+  return UnifiedObject::nameLess(a.second, b.second);
+}
+
+void UnifiedObject::sortLinked() const
+{
+  if (linkedSorted_ == linked_.size())
+    return;
+  const auto middle = linked_.begin() + linkedSorted_;
+  sort(middle, linked_.end(), linkLess);
+  inplace_merge(linked_.begin(), middle, linked_.end(), linkLess);
+  linkedSorted_ = linked_.size();
+}
+
+void UnifiedObject::addLink(PropType pt, UnifiedObject* owner)
+{
+  markChanged(osAddLink);
+  linked_.emplace_back(pt, owner);
+}
+
+void UnifiedObject::removeLink(PropType pt, UnifiedObject* owner)
+{
+  const Link link(pt, owner);
+  if (!linked_.empty() && linked_.back() == link)
+    linked_.pop_back();
+  else
+  {
+    sortLinked();
+    auto it = lower_bound(linked_.begin(), linked_.end(), link, linkLess);
+    if (it == linked_.end() || *it != link)
+      throw ErrorCode(1265);
+    linked_.erase(it);
+  }
+  linkedSorted_ = min(linkedSorted_, linked_.size());
+  markChanged(osDelLink);
+}
+
+UnifiedObject::LinkedObjIterContainer UnifiedObject::linked(PropType pt) const
+{
+  sortLinked();
+  if (pt == 0)
+    return { linked_.begin(), linked_.end() };
+  const auto range = equal_range(linked_.begin(), linked_.end(), Link(pt, nullptr),
+    [](const Link& a, const Link& b) { return a.first < b.first; });
+  return { range.first, range.second };
+}
+
+void UnifiedObject::putProp(Property& p)
+{
+  p.putInto(this);
+  if (p.def().searchable())
+    if (TopObjectStorage * doc = document())
+      doc->indexProp(p, this);
+}
+
+void UnifiedObject::takeProp(Property& p)
+{
+  p.removeFrom(this);
+  if (p.def().searchable())
+    if (TopObjectStorage * doc = document())
+      doc->unindexProp(p, this);
+}
+
+uint64_t UnifiedObject::linksEpoch() const
+{
+  return storage_ ? storage_->linksEpoch() : 0;
+}
+
+TopObjectStorage * UnifiedObject::document() const
+{
+  for (ObjectStorage * stor = storage_; stor; stor = stor->storage())
+    if (TopObjectStorage * doc = stor->isDocument())
+      return doc;
+  return nullptr;
+}
+
+void UnifiedObject::addToChanged()
+{
+  if (TopObjectStorage * doc = document())
+    doc->changed_.push_back(this);
+}
+
 void UnifiedObject::initIfChangedAndClearState()
 {
   if (state_ & (~osActive))
@@ -109,29 +234,52 @@ void UnifiedObject::initIfChangedAndClearState()
 
 const Property * UnifiedObject::findProp(PropType pt) const
 {
-  auto it = findPropIterator(pt);
-  if (it != props_.end() && (*it)->type() == pt)
-    return it->get();
+  const size_t i = findPropIndex(pt);
+  if (hasPropAt(i, pt))
+    return props_[i].second.get();
 
   return nullptr;
 }
 
-vector<PropPtr>::iterator UnifiedObject::findPropIterator(PropType pt) const
+void UnifiedObject::appendProp(PropPtr p)
+{
+  const PropType pt = p->type();
+  if (!props_.empty() && props_.back().first >= pt)
+    resortProps_ = true;
+  props_.emplace_back(pt, move(p));
+}
+
+// Objects have a few properties appended mostly in order, so insertion sort is enough
+void UnifiedObject::sortProps() const
 {
-  if (resortProps_)
+  if (!resortProps_)
+    return;
+  resortProps_ = false;
+  for (size_t i = 1; i < props_.size(); i++)
   {
-    static const auto compare = [](PropPtr a, PropPtr b)
-    {
-      return static_cast<int>(a->type()) < static_cast<int>(b->type());
-    };
-    resortProps_ = false;
-    std::sort(props_.begin(), props_.end(), compare);
+    if (props_[i - 1].first <= props_[i].first)
+      continue;
+    PropSlot p = move(props_[i]);
+    size_t j = i;
+    for (; j > 0 && props_[j - 1].first > p.first; j--)
+      props_[j] = move(props_[j - 1]);
+    props_[j] = move(p);
   }
-  static const auto compare2 = [](PropPtr value, PropType pt)
-  {
-    return static_cast<int>(value->type()) < static_cast<int>(pt);
-  };
-  return lower_bound(props_.begin(), props_.end(), pt, compare2);
+}
+
+size_t UnifiedObject::findPropIndex(PropType pt) const
+{
+  sortProps();
+  return lower_bound(props_.begin(), props_.end(), pt, [](const PropSlot& p, PropType pt) { return p.first < pt; }) - props_.begin();
+}
+
+bool UnifiedObject::nameLess(const UnifiedObject * a, const UnifiedObject * b)
+{
+  if (a == b)
+    return false;
+  if (a->storage_ == b->storage_)
+    return a->name_ < b->name_;
+  return a->LName() < b->LName();
 }
 
 LongName UnifiedObject::LName() const
@@ -175,23 +323,6 @@ ObjectChanges::ObjectChanges(const LongName & name)
   name_ = name;
 }
 
-ObjectChanges::ObjectChanges(Reader & r)
-{
-  r.getVector(name_);
-  objType_ = static_cast<ObjType>(r.getInt());
-
-  r.getVector(del_); 
-
-  size_t count = r.getMap(); 
-  props_.reserve(count);
-  while (count--)
-  {
-    PropType type = static_cast<PropType>(r.getInt());
-
-    props_.emplace_back(Property::propDefs_.get(type).creator_(r));
-  }
-}
-
 void ObjectChanges::write(Writer & w) const
 {
 
@@ -267,7 +398,13 @@ ObjectChanges & ObjectChanges::prop(Property * pv)
     delete pv;
     return *this;
   }
+  return prop(PropPtr(pv));
+}
 
+ObjectChanges & ObjectChanges::prop(PropPtr pv)
+{
+  if (objType_ == ObjTypeDeleted)
+    return *this;
 
   for (auto it = props_.begin(); it != props_.end(); ++it)
     if ((*it)->type() == pv->type())
@@ -276,7 +413,7 @@ ObjectChanges & ObjectChanges::prop(Property * pv)
       break;
     }
 
-  props_.push_back(PropPtr(pv));
+  props_.push_back(pv);
 
   auto it = find(del_.begin(), del_.end(), pv->type());
   if (it != del_.end())
@@ -306,6 +443,12 @@ void ObjectChanges::remove()
   del_.clear();
 }
 
+void ObjectChanges::recreate(ObjType type)
+{
+  ASSERT(type != ObjTypeDeleted && type != ObjTypeUnchanged);
+  objType_ = type;
+}
+
 
 bool ObjectChanges::isFirstObject() const
 {
@@ -326,7 +469,7 @@ PropPtr ObjectChanges::findProp(PropType pt) const
 
 
 
-UnifiedObject* LinkToObject::findLinkedObject(const UnifiedObject* propertyOwner) const
+UnifiedObject* LinkToObject::resolve(const UnifiedObject* propertyOwner) const
 {
   if (!propertyOwner || name_.empty())
     return nullptr;
@@ -340,6 +483,70 @@ UnifiedObject* LinkToObject::findLinkedObject(const UnifiedObject* propertyOwner
   if (!stor)
     return nullptr;
 
-  return stor->findObject(name_);
+  cached_ = stor->findObject(name_);
+  cachedOwner_ = propertyOwner;
+  cachedEpoch_ = propertyOwner->linksEpoch();
+  return cached_;
+}
+
+
+
+void * ObjectArena::allocate(size_t size)
+{
+  size = (size + HeaderSize - 1) / HeaderSize * HeaderSize + HeaderSize;
+  auto it = free_.find(size);
+  if (it != free_.end() && it->second)
+  {
+    void * p = it->second;
+    it->second = *static_cast<void**>(p);
+    return p;
+  }
+
+  while (current_ < blocks_.size() && used_ + size > blocks_[current_].size_)
+  {
+    current_++;
+    used_ = 0;
+  }
+  if (current_ == blocks_.size())
+    blocks_.push_back({ unique_ptr<uint8_t[]>(new uint8_t[max(size, BlockSize)]), max(size, BlockSize) });
+
+  uint8_t * p = blocks_[current_].data_.get() + used_;
+  used_ += size;
+  *reinterpret_cast<size_t*>(p) = size;
+  return p + HeaderSize;
+}
+
+void ObjectArena::deallocate(void * p)
+{
+  const size_t size = *reinterpret_cast<size_t*>(static_cast<uint8_t*>(p) - HeaderSize);
+  void *& head = free_[size];
+  *static_cast<void**>(p) = head;
+  head = p;
+}
+
+// The allocation starts at the most derived object, UnifiedObject may be not its first base
+void ObjectArena::destroy(UnifiedObject * obj)
+{
+  void * p = dynamic_cast<void*>(obj);
+  obj->~UnifiedObject();
+  if (!resetting_)
+    deallocate(p);
+}
+
+void ObjectArena::reset()
+{
+  current_ = 0;
+  used_ = 0;
+  free_.clear();
+  resetting_ = false;
+  if (blocks_.size() > KeptBlocks)
+    blocks_.erase(blocks_.begin() + KeptBlocks, blocks_.end());
 }
 
+size_t ObjectArena::capacity() const
+{
+  size_t res = 0;
+  for (const Block & b : blocks_)
+    res += b.size_;
+  return res;
+}
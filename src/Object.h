@@ -7,7 +7,9 @@
 
 class UnifiedObject;
 class ObjectStorage;
+class TopObjectStorage;
 struct ObjectChanges;
+class TrzUndo;
 
 
 using ObjType = int;
@@ -25,16 +27,78 @@ public:
   LongName(const initializer_list<ObjName>& list) : vector<ObjName>(list) {}
 };
 
+struct LongNameHash
+{
+  size_t operator()(const LongName& name) const noexcept
+  {
+    size_t h = name.size();
+    for (ObjName n : name)
+      h ^= n + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2);
+    return h;
+  }
+};
+
+
+
+
 
 
 
 
+// Memory of objects of a document. Objects are allocated from large blocks, freed memory is reused for
+// objects of the same size, and reset() frees all objects at once when the document is rebuilt.
+class ObjectArena
+{
+public:
+  static constexpr size_t BlockSize = 256 * 1024;
+  static constexpr size_t KeptBlocks = 4;
+
+  ObjectArena() = default;
+
+  void * allocate(size_t);
+  void deallocate(void *);
 
+  template <class T> T * create() { return new (allocate(sizeof(T))) T(); }
+  void destroy(UnifiedObject *);
+
+  // Objects must be destroyed before, KeptBlocks blocks are kept for the next objects and others are freed
+  void reset();
+  // Objects destroyed until reset() don't put their memory to the free lists
+  inline void prepareReset() { resetting_ = true; }
+
+  // Size of all blocks
+  size_t capacity() const;
+
+private:
+  // Every allocation is prefixed by its size, the header keeps the alignment of objects
+  static constexpr size_t HeaderSize = alignof(max_align_t);
+
+  struct Block
+  {
+    unique_ptr<uint8_t[]> data_;
+    size_t size_;
+  };
+  vector<Block> blocks_;
+  size_t current_ = 0; // block the objects are allocated from
+  size_t used_ = 0;    // bytes used in the current block
+  bool resetting_ = false;
+
+  // Freed allocations by size, linked through their memory
+  unordered_map<size_t, void*> free_;
+
+  ObjectArena(const ObjectArena&) = delete;
+  void operator=(const ObjectArena&) = delete;
+};
 
 
 enum OBJ_FLAGS
 {
-  TOPOBJECT = 1
+  TOPOBJECT = 1,
+
+  // Class of data for partial loading, see TrzFilter. Nested objects belong to the class of the top level object.
+  DOCINFO = 2,
+  STRINGS = 4,
+  SYMBOLS = 8,
 };
 
 
@@ -65,7 +129,7 @@ public:
     ObjType id_;
     int flags_; 
     string name_; 
-    function<UnifiedObject* ()> creator_;
+    function<UnifiedObject* (ObjectArena&)> creator_;
 
     bool inline isTopObject() const { return 0 != (TOPOBJECT & flags_); }
   };
@@ -75,33 +139,53 @@ public:
   template<class T>
   static void addObjectDefinition(const string& name, int flags)
   {
-    objDefs_.add<std::function<UnifiedObject*()>>(T::typeId_, flags, name, [](){ return new T(); });
+    objDefs_.add<std::function<UnifiedObject*(ObjectArena&)>>(T::typeId_, flags, name, [](ObjectArena& a){ return a.create<T>(); });
   }
 
   virtual const Definition& def() const = 0;
 
 private:
 
-  struct LinkedObjIterContainer
+  using Link = pair<PropType, UnifiedObject*>;
+
+  // Property with its type, so lookup is a binary search in a contiguous array without dereferencing
+  // the properties and calling virtual type()
+  using PropSlot = pair<PropType, PropPtr>;
+
+  // Properties of the object
+  struct PropsContainer
   {
-    struct Iter 
+    struct Iter
     {
-      const LinkedObjIterContainer& container_;
-      size_t pos_;
+      vector<PropSlot>::const_iterator it_;
 
-      bool operator!= (const Iter& other) const { return pos_ != other.pos_; }
-      const Iter& operator++ () { pos_ = findNext(container_, pos_); return *this; }
+      bool operator!= (const Iter& other) const { return it_ != other.it_; }
+      const Iter& operator++ () { ++it_; return *this; }
+      const PropPtr& operator* () const { return it_->second; }
+    };
 
-      static size_t findNext(const LinkedObjIterContainer& container_, size_t pos);
+    Iter begin() const { return{ props_.begin() }; }
+    Iter end() const { return{ props_.end() }; }
+    size_t size() const { return props_.size(); }
+    const vector<PropSlot>& props_;
+  };
+
+  // Objects linking to this one by the property type
+  struct LinkedObjIterContainer
+  {
+    struct Iter 
+    {
+      vector<Link>::const_iterator it_;
 
-      UnifiedObject* operator* () const { return container_.objects_[pos_].second; }
+      bool operator!= (const Iter& other) const { return it_ != other.it_; }
+      const Iter& operator++ () { ++it_; return *this; }
+      UnifiedObject* operator* () const { return it_->second; }
     };
 
-    explicit LinkedObjIterContainer(PropType pt, const vector<pair<PropType, UnifiedObject*>>& objects) : propType_(pt), objects_(objects) {}
-    Iter begin() const { return{ *this, Iter::findNext(*this, SIZE_MAX) }; }
-    Iter end() const { return{ *this, objects_.size() }; }
-    const vector<pair<PropType, UnifiedObject*>>& objects_;
-    const PropType propType_;
+    Iter begin() const { return{ begin_ }; }
+    Iter end() const { return{ end_ }; }
+    vector<Link>::const_iterator begin_;
+    vector<Link>::const_iterator end_;
   };
 
 
@@ -118,6 +202,9 @@ public:
 
   LongName LName() const;
 
+  // Order of objects by their long names, objects of one storage are compared by names only
+  static bool nameLess(const UnifiedObject*, const UnifiedObject*);
+
   ObjectStorage& storage() const
   {
     if (!storage_)
@@ -125,11 +212,12 @@ public:
     return *storage_;
   }
 
-  bool changeRemove();
+  // Changes made by applied tranzaction, reverting changes are collected to undo if it isn't null
+  bool changeRemove(TrzUndo* undo = nullptr);
 
-  bool changeRemove(PropType pt);
+  bool changeRemove(PropType pt, TrzUndo* undo = nullptr);
 
-  void change(const ObjectChanges& chgs);
+  void change(const ObjectChanges& chgs, TrzUndo* undo = nullptr);
 
   string debugString() const;
   
@@ -145,12 +233,16 @@ public:
 
   inline size_t propertyCount() const { return props_.size(); }
 
-  inline const vector<PropPtr>& props() const { return props_; }
+  inline PropsContainer props() const { return{ props_ }; }
 
-  LinkedObjIterContainer linked(PropType pt = 0) const { return LinkedObjIterContainer(pt, linked_); }
+  // All linking objects if the type is 0, ordered by the type and long names of the objects
+  LinkedObjIterContainer linked(PropType pt = 0) const;
 
   vector<int> availableEnums(PropType) const; 
 
+  // Epoch of links of the storages tree the object belongs to, see ObjectStorage::linksEpoch()
+  uint64_t linksEpoch() const;
+
   virtual ~UnifiedObject() = default;
 
 protected:
@@ -165,15 +257,43 @@ private:
 
   // Object cannot have several properties with same type.
   // Object may be empty, it is useful sometimes.
-  mutable vector<PropPtr> props_;    
-  mutable bool resortProps_ = false; 
+  mutable vector<PropSlot> props_;    
 
-  vector<PropPtr>::iterator findPropIterator(PropType pt) const;
+  void sortProps() const;
+  // Index of the property or of the position to insert it
+  size_t findPropIndex(PropType pt) const;
+  inline bool hasPropAt(size_t i, PropType pt) const { return i < props_.size() && props_[i].first == pt; }
+  void appendProp(PropPtr);
 
+  // Links are sorted by type and long name of the object up to linkedSorted_, new links are appended and merged on the first
+  // lookup, so bulk loading of many links to one object doesn't resort on every link
   friend class LinkToObject;
-  vector<pair<PropType, UnifiedObject*>> linked_;
+  mutable vector<Link> linked_;
+  mutable size_t linkedSorted_ = 0;
+  void sortLinked() const;
+  void addLink(PropType, UnifiedObject*);
+  void removeLink(PropType, UnifiedObject*);
 
   uint16_t state_ = 0;
+  mutable bool resortProps_ = false; 
+
+  // The first change since the latest onChange() adds the object to the document's list of changed
+  // objects, so only they are initialized after the tranzaction is applied
+  inline void setState(uint16_t state)
+  {
+    if (!(state_ & ~osActive) && (state & ~osActive))
+      addToChanged();
+    state_ = state;
+  }
+  inline void markChanged(uint16_t flags) { setState(state_ | flags); }
+  void addToChanged();
+
+  // Nearest document of the object, it keeps the changed objects list and property indexes
+  TopObjectStorage * document() const;
+
+  // Put the property into or take it from the object, links and indexes of searchable properties are updated
+  void putProp(Property&);
+  void takeProp(Property&);
 
 
   // Assygned by ObjectStorage while object creating
@@ -202,7 +322,18 @@ struct ObjectChanges
   ObjectChanges(const LongName&);                // Change or delete of object or property
 
   // Construct from tranzaction storage archive
-  ObjectChanges(Reader&);
+  template <ReaderType R> explicit ObjectChanges(R& r)
+  {
+    r.getVector(name_);
+    objType_ = r.template getInt<ObjType>();
+    readBody(r);
+  }
+  template <ReaderType R> ObjectChanges(const LongName& name, ObjType type, R& r) // name and type are already read
+  : name_(name),
+    objType_(type)
+  {
+    readBody(r);
+  }
 
   void write(Writer&) const;
 
@@ -211,8 +342,10 @@ struct ObjectChanges
 
   // Apply changes
   ObjectChanges & prop(Property*);  // Add or change property. This object become owner of the property object
+  ObjectChanges & prop(PropPtr);    // Add or change property shared with other changes
   ObjectChanges & remove(PropType); // Delete property
   void remove();                    // Delete object
+  void recreate(ObjType);           // Create deleted object again with the same name
 
 
   inline const LongName & objName() const { return name_; }
@@ -242,6 +375,22 @@ protected:
   vector<PropType> del_;
 
 private:
+  template <ReaderType R> void readBody(R& r)
+  {
+    r.getVector(del_); 
+
+    size_t count = r.getMap(); 
+    props_.reserve(count);
+    while (count--)
+    {
+      const Property::Definition& def = Property::propDefs_.get(r.template getInt<PropType>());
+      if constexpr (is_base_of_v<CborReader, R>)
+        props_.emplace_back(def.cborCreator_(r));
+      else
+        props_.emplace_back(def.creator_(r));
+    }
+  }
+
   ObjectChanges(const ObjectChanges&) = delete;
   void operator = (const ObjectChanges&) = delete;
 };
@@ -255,31 +404,16 @@ public:
   void makeLink(PropType pt, UnifiedObject* owner)
   {
     if (UnifiedObject* obj = findLinkedObject(owner))
-    {
-      obj->state_ |= osAddLink;
-      obj->linked_.emplace_back(pt, owner);
-      sort(obj->linked_.begin(), obj->linked_.end(),
-        [](const pair<PropType, UnifiedObject*>& p1, const pair<PropType, UnifiedObject*>& p2)
-        { return int(p1.first) < int(p2.first); });
-    }
+      obj->addLink(pt, owner);
   }
 
   void removeLink(PropType pt, UnifiedObject* owner)
   {
     if (UnifiedObject* obj = findLinkedObject(owner))
-    {
-      for (auto it = obj->linked_.begin(); it != obj->linked_.end(); ++it)
-        if (it->first == pt && it->second == owner)
-        {
-          obj->linked_.erase(it);
-          obj->state_ |= osDelLink;
-          return;
-        }
-      throw ErrorCode(1265);
-    }
+      obj->removeLink(pt, owner);
   }
 
-  void read(Reader& r)
+  template <ReaderType R> void read(R& r)
   {
     vector<uint32_t> tmp;
     r.getVector(tmp);
@@ -294,6 +428,7 @@ public:
       name_.clear();
       ASSERT(false == (bool)*this);
     }
+    cachedEpoch_ = 0;
   }
 
   void write(Writer& w) const
@@ -318,10 +453,23 @@ public:
 
   LongName name_;
 
-  UnifiedObject* findLinkedObject(const UnifiedObject* propertyOwner) const;
+  inline UnifiedObject* findLinkedObject(const UnifiedObject* propertyOwner) const
+  {
+    if (propertyOwner == cachedOwner_ && cachedEpoch_ == propertyOwner->linksEpoch())
+      return cached_;
+    return resolve(propertyOwner);
+  }
 
 
   operator bool() const { return !name_.empty(); }
+
+private:
+  // Property value may be shared by several objects, the object resolved for the latest owner is cached
+  mutable const UnifiedObject* cachedOwner_ = nullptr;
+  mutable UnifiedObject* cached_ = nullptr;
+  mutable uint64_t cachedEpoch_ = 0;
+
+  UnifiedObject* resolve(const UnifiedObject* propertyOwner) const;
 };
 
 
@@ -335,7 +483,7 @@ public:
   const Definition& def() const override { static const Definition* d; return *(d ? d : d = &propDefs_.get(PT)); }
 
   explicit PropValueTemplate(uint32_t upStor, const LongName& name) { upStor_ = upStor; name_ = name; }
-  explicit PropValueTemplate(Reader& r) { LinkToObject::read(r); }
+  template <ReaderType R> explicit PropValueTemplate(R& r) { LinkToObject::read(r); }
 
   void write(Writer& w) const override { LinkToObject::write(w); }
 
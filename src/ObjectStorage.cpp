@@ -1,9 +1,12 @@
 ﻿
 #include "ObjectStorage.h"
 #include "TranzactionStorage.h"
+#include "DocumentStorage.h"
 
 
 
+atomic<uint64_t> ObjectStorage::nextLinksEpoch_ = 1;
+
 ObjectStorage::~ObjectStorage()
 {
   clear();
@@ -11,9 +14,32 @@ ObjectStorage::~ObjectStorage()
 
 void ObjectStorage::clear()
 {
+  linksChanged();
+  deleted_ = 0;
+  compactPending_ = false; // the document drops its queue too
+  ASSERT(arena_ || objects_.empty());
   for (UnifiedObject * obj : objects_)
-    delete obj;
+    arena_->destroy(obj);
   objects_.clear();
+  byType_.clear();
+}
+
+// Nested storages allocate their objects from the arena of the document
+UnifiedObject * ObjectStorage::createObject(ObjType type)
+{
+  if (!arena_)
+  {
+    ownArena_.reset(new ObjectArena);
+    arena_ = ownArena_.get();
+  }
+  UnifiedObject * obj = UnifiedObject::objDefs_.get(type).creator_(*arena_);
+  if (ObjectStorage * storage = obj->isStorage())
+  {
+    storage->rootEpoch_ = rootEpoch_;
+    if (!storage->isDocument())
+      storage->arena_ = arena_;
+  }
+  return obj;
 }
 
 vector<UnifiedObject*>::const_iterator ObjectStorage::findObjectIterator(ObjName objName) const
@@ -37,10 +63,60 @@ UnifiedObject * ObjectStorage::findObjectByName(ObjName objName) const
 
 UnifiedObject * ObjectStorage::findObjectByType(ObjType objType) const
 {
-  for (UnifiedObject *obj : objects_)
-    if (obj->type() == objType && obj->isActive())
-      return obj;
-  return nullptr;
+  auto it = byType_.find(objType);
+  return it != byType_.end() && !it->second.empty() ? it->second.front() : nullptr;
+}
+
+const vector<UnifiedObject*> & ObjectStorage::objectsOfType(ObjType objType) const
+{
+  static const vector<UnifiedObject*> empty;
+  auto it = byType_.find(objType);
+  return it != byType_.end() ? it->second : empty;
+}
+
+// Objects are created with growing names mostly, so they are appended
+void ObjectStorage::addToTypeIndex(UnifiedObject * obj)
+{
+  vector<UnifiedObject*> & objects = byType_[obj->type()];
+  auto it = objects.end();
+  if (!objects.empty() && objects.back()->name() > obj->name())
+    it = lower_bound(objects.begin(), objects.end(), obj->name(),
+      [](const UnifiedObject * o, ObjName name) { return o->name() < name; });
+  objects.insert(it, obj);
+}
+
+// Deleted objects are grouped by storage and type and sorted by name, so every index is compacted by one
+// pass from the first deleted object and a cascade delete stays linear
+void ObjectStorage::removeFromTypeIndexes(vector<UnifiedObject*> deleted)
+{
+  erase_if(deleted, [](const UnifiedObject * obj) { return !obj->storage_; });
+  for (UnifiedObject * obj : deleted)
+    obj->storage_->objectDeleted();
+  sort(deleted.begin(), deleted.end(), [](const UnifiedObject * a, const UnifiedObject * b)
+  {
+    if (a->storage_ != b->storage_)
+      return a->storage_ < b->storage_;
+    if (a->type() != b->type())
+      return a->type() < b->type();
+    return a->name() < b->name();
+  });
+  for (auto first = deleted.begin(); first != deleted.end();)
+  {
+    ObjectStorage * storage = (*first)->storage_;
+    const ObjType type = (*first)->type();
+    const auto last = find_if(first, deleted.end(), [&](const UnifiedObject * obj) { return obj->storage_ != storage || obj->type() != type; });
+    vector<UnifiedObject*> & objects = storage->byType_[type];
+    auto from = lower_bound(objects.begin(), objects.end(), (*first)->name(),
+      [](const UnifiedObject * o, ObjName name) { return o->name() < name; });
+    objects.erase(remove_if(from, objects.end(), [&](const UnifiedObject * obj)
+    {
+      if (first == last || obj != *first)
+        return false;
+      ++first;
+      return true;
+    }), objects.end());
+    first = last;
+  }
 }
 
 
@@ -93,29 +169,77 @@ UnifiedObject * ObjectStorage::findObject(const LongName & name) const
 }
 
 
-string ObjectStorage::debugString() const
+ObjectStorage::IterContainer::Iter ObjectStorage::IterContainer::begin() const
 {
-  string res;
-  for (const UnifiedObject * obj : objects_)
+  Iter it{ {}, end_, withChildren_ };
+  if (begin_ < end_)
   {
-    if (obj->isActive())
-    {
-      const string & nameType = to_string(int(obj->type())) + "#" + to_string(obj->name());
-      const string & props = obj->debugString(); 
-      res += nameType + "[" + props;
-      if (ObjectStorage * str = obj->isStorage())
+    it.stack_.reserve(8);
+    it.stack_.push_back({ &objects_, begin_ });
+  }
+  return it;
+}
+
+const ObjectStorage::IterContainer::Iter& ObjectStorage::IterContainer::Iter::operator++ ()
+{
+  if (withChildren_ && !skipChildren_)
+    if (ObjectStorage * storage = (**this).isStorage())
+      if (!storage->objects_.empty())
       {
-        const string & nestedObjects = str->debugString();
-        if (!props.empty() && !nestedObjects.empty())
-          res += ',';
-        res += nestedObjects;
+        stack_.push_back({ &storage->objects_, 0 });
+        return *this;
       }
-      res += "]";
-    }
+  skipChildren_ = false;
+
+  while (!stack_.empty())
+  {
+    Level & level = stack_.back();
+    if (++level.pos_ < (stack_.size() == 1 ? end_ : level.objects_->size()))
+      break;
+    stack_.pop_back();
   }
+  return *this;
+}
+
+vector<ObjectStorage::IterContainer> ObjectStorage::IterContainer::split(size_t parts) const
+{
+  vector<IterContainer> res;
+  const size_t count = end_ - min(begin_, end_);
+  parts = max<size_t>(1, min(parts, count));
+  res.reserve(parts);
+  for (size_t i = 0; i < parts; i++)
+    res.emplace_back(objects_, withChildren_, begin_ + count * i / parts, begin_ + count * (i + 1) / parts);
   return res;
+}
 
 
+string ObjectStorage::debugString() const
+{
+  string res;
+  // Objects with not closed brackets, true if the object has properties and no nested objects written yet
+  vector<bool> open;
+  const IterContainer range = objects(true);
+  for (auto it = range.begin(); it != range.end(); ++it)
+  {
+    const UnifiedObject & obj = *it;
+    if (!obj.isActive())
+    {
+      it.skipChildren();
+      continue;
+    }
+    for (; open.size() > it.depth(); open.pop_back())
+      res += ']';
+    if (!open.empty() && open.back())
+    {
+      res += ',';
+      open.back() = false;
+    }
+    const string & props = obj.debugString();
+    res += to_string(int(obj.type())) + "#" + to_string(obj.name()) + "[" + props;
+    open.push_back(!props.empty());
+  }
+  res.append(open.size(), ']');
+  return res;
 }
 
 
@@ -157,18 +281,106 @@ void ObjectStorage::save(Writer& w, bool onlySelected) const
 
 
 
-size_t ObjectStorage::size(bool withChildren) const noexcept
+// State is [nextName, [object...]], object is [name, type, active, {propType:value}, childrenState|null]
+void ObjectStorage::writeState(Writer& w) const
 {
-  size_t count = 0;
+  w.putArray(2);
+  w.putInt(nextName_);
+  w.putArray(objects_.size());
   for (const UnifiedObject * obj : objects_)
   {
+    w.putArray(5);
+    w.putInt(obj->name());
+    w.putInt(obj->type());
+    w.putInt(obj->isActive());
+
+    obj->sortProps();
+    w.putMap(obj->propertyCount());
+    for (const PropPtr& p : obj->props())
+    {
+      w.save(p->type());
+      p->write(w);
+    }
+
+    if (ObjectStorage * storage = obj->isStorage())
+      storage->writeState(w);
+    else
+      w.putNull();
+  }
+}
+
+void ObjectStorage::readState(Reader& r)
+{
+  ASSERT(objects_.empty());
+  r.getArray(2);
+  nextName_ = r.getInt<ObjName>();
+  size_t count = r.getArray();
+  objects_.reserve(count);
+  while (count--)
+  {
+    r.getArray(5);
+    const ObjName name = r.getInt<ObjName>();
+    UnifiedObject * obj = createObject(r.getInt<ObjType>());
+    objects_.push_back(obj);
+    obj->name_ = name;
+    obj->storage_ = this;
+    obj->setState(r.getInt() ? (osActive | osCreated) : 0);
     if (obj->isActive())
+      addToTypeIndex(obj);
+    else
+      deleted_++;
+
+    size_t propCount = r.getMap();
+    obj->props_.reserve(propCount);
+    while (propCount--)
     {
-      count ++;
-      if (withChildren)
-        if (ObjectStorage * storage = obj->isStorage())
-          count += storage->size(withChildren);
+      const PropType type = r.getInt<PropType>();
+      obj->appendProp(Property::propDefs_.get(type).creator_(r));
     }
+
+    if (r.isNull())
+      r.getNull();
+    else if (ObjectStorage * storage = obj->isStorage())
+      storage->readState(r);
+    else
+      throw ErrorCode(SerializationFormatError);
+  }
+
+  if (!isObject())
+    restoreLinks(); 
+}
+
+// Links can be resolved only when the whole objects tree exists
+void ObjectStorage::restoreLinks()
+{
+  for (UnifiedObject * obj : objects_)
+  {
+    for (const UnifiedObject::PropSlot& p : obj->props_)
+      obj->putProp(*p.second);
+    if (ObjectStorage * storage = obj->isStorage())
+      storage->restoreLinks();
+  }
+}
+
+bool ObjectStorage::hasDocuments() const
+{
+  for (const UnifiedObject * obj : objects_)
+    if (ObjectStorage * storage = obj->isStorage())
+      if (storage->isDocument() || storage->hasDocuments())
+        return true;
+  return false;
+}
+
+size_t ObjectStorage::size(bool withChildren) const noexcept
+{
+  size_t count = 0;
+  const IterContainer range = objects(withChildren);
+  for (auto it = range.begin(); it != range.end(); ++it)
+  {
+    if ((*it).isActive())
+      count++;
+    else
+      it.skipChildren();
   }
   return count;
 }
@@ -177,10 +389,55 @@ size_t ObjectStorage::size(bool withChildren) const noexcept
 
 
 
+void ObjectStorage::objectDeleted()
+{
+  deleted_++;
+  if (compactPending_ || deleted_ < CompactMinDeleted || deleted_ * 2 < objects_.size())
+    return;
+  for (ObjectStorage * stor = this; stor; stor = stor->storage())
+    if (TopObjectStorage * doc = stor->isDocument())
+    {
+      doc->compact_.push_back(this);
+      compactPending_ = true;
+      return;
+    }
+}
+
+size_t ObjectStorage::compact(bool withChildren)
+{
+  size_t bytes = 0;
+  const size_t capacity = objects_.capacity();
+  auto out = objects_.begin();
+  for (UnifiedObject * obj : objects_)
+  {
+    ObjectStorage * storage = obj->isStorage();
+    if (!obj->isActive() && !(storage && (storage->isDocument() || !storage->objects_.empty())))
+    {
+      // Memory of the object itself stays in the arena for new objects
+      bytes += obj->props_.capacity() * sizeof(UnifiedObject::PropSlot) + obj->linked_.capacity() * sizeof(UnifiedObject::Link);
+      arena_->destroy(obj);
+      deleted_--;
+      continue;
+    }
+    if (withChildren && storage)
+      bytes += storage->compact(true);
+    *out++ = obj;
+  }
+  if (out != objects_.end())
+  {
+    objects_.erase(out, objects_.end());
+    objects_.shrink_to_fit();
+    bytes += (capacity - objects_.capacity()) * sizeof(UnifiedObject*);
+    linksChanged();
+  }
+  return bytes;
+}
+
 UnifiedObject * ObjectStorage::create(ObjType type, ObjName name)
 {
   UnifiedObject * obj = nullptr;
   ASSERT(name != 0);
+  linksChanged();
 
   auto it = findObjectIterator(name);
   if (it != objects_.end() && (*it)->name() == name)
@@ -188,40 +445,248 @@ UnifiedObject * ObjectStorage::create(ObjType type, ObjName name)
     obj = *it;
     if (obj->isActive())
       throw ErrorCode(1250);
-    obj->state_ = osActive | osCreated;
+    deleted_--;
+    obj->setState(osActive | osCreated);
+    addToTypeIndex(obj);
     return obj;
   }
 
   if (name >= nextName_)
     nextName_ = name + 1;
 
-  obj = UnifiedObject::objDefs_.get(type).creator_();
+  obj = createObject(type);
+  if (obj->def().isTopObject() && name != 1)
+  {
+    arena_->destroy(obj);
+    throw ErrorCode(1253);
+  }
 
   ASSERT(name > 0);
   obj->name_ = name;
   obj->storage_ = this;
-  obj->state_ = osActive | osCreated;
-
-  if (obj->def().isTopObject() && name != 1)
-    throw ErrorCode(1253);
+  obj->setState(osActive | osCreated);
 
-  objects_.push_back(obj);
+  objects_.insert(it, obj);
+  addToTypeIndex(obj);
   return obj;
 }
 
+TopObjectStorage::~TopObjectStorage()
+{
+  clear();
+}
+
 void TopObjectStorage::setTranzactions(DocId docId, const vector<TrzPtr> & trzs, datetime_t current)
 {
+  vector<TrzPtr> target;
+  for (const TrzPtr& trz : trzs)
+    if (trz->created() <= current && trz->enabled())
+      target.push_back(trz);
+
+  size_t common = 0;
+  while (common < applied_.size() && common < target.size() && applied_[common].trz_ == target[common])
+    common++;
+
+  if (revertTo(common))
+  {
+    for (auto it = target.begin() + common; it != target.end(); ++it)
+    {
+      unique_ptr<TrzUndo> undo(new TrzUndo);
+      applyWithoutInit(*it, undo.get());
+      pushApplied(*it, move(undo));
+    }
+  }
+  else
+    rebuild(target, current);
+
+  initChanged();
+  compactPending();
+}
+
+// Revert the latest tranzactions keeping count of applied ones, return false if the document has to be rebuilt
+bool TopObjectStorage::revertTo(size_t count)
+{
+  if (applied_.empty())
+    return false;
+  for (size_t i = count; i < applied_.size(); i++)
+    if (!applied_[i].undo_ || !applied_[i].undo_->valid())
+      return false;
+
+  try
+  {
+    while (applied_.size() > count)
+    {
+      applied_.back().undo_->revert(*this);
+      applied_.pop_back();
+    }
+  }
+  catch (const std::exception&)
+  {
+    return false;
+  }
+  return true;
+}
+
+void TopObjectStorage::rebuild(const vector<TrzPtr> & trzs, datetime_t current)
+{
+  documentArena_.prepareReset();
   clear();
+  documentArena_.reset();
+  applied_.clear();
+  changed_.clear();
+  compact_.clear();
+  indexes_.clear();
+
+  auto it = trzs.begin();
+  if (SnapshotPtr s = hub() ? hub()->snapshot(current) : nullptr)
+  {
+    CborMemReader r(s->state_);
+    readState(r);
+    it = upper_bound(trzs.begin(), trzs.end(), s->created_,
+      [](datetime_t t, const TrzPtr & trz) { return t < trz->created(); });
+    for (auto sit = trzs.begin(); sit != it; ++sit)
+      applied_.push_back({ *sit, nullptr });
+  }
 
-  for (TrzPtr trz : trzs)
+  try
   {
-    if (trz->created() <= current && trz->enabled())
-      applyWithoutInit(trz);
+    for (; it != trzs.end(); ++it)
+    {
+      unique_ptr<TrzUndo> undo;
+      if (size_t(trzs.end() - it) <= MaxUndoDepth)
+        undo.reset(new TrzUndo);
+      applyWithoutInit(*it, undo.get());
+      pushApplied(*it, move(undo));
+    }
   }
+  catch (const std::exception&)
+  {
+    applied_.clear();
+    throw;
+  }
+}
 
+// onChange() may change other objects, they are appended to the list while iterating.
+// If onChange() throws, the rest of objects are initialized by the next call.
+void TopObjectStorage::initChanged()
+{
+  size_t i = 0;
+  try
+  {
+    for (; i < changed_.size(); i++)
+      changed_[i]->initIfChangedAndClearState();
+  }
+  catch (const std::exception&)
+  {
+    changed_.erase(changed_.begin(), changed_.begin() + i);
+    initialized_ += i;
+    throw;
+  }
+  initialized_ += changed_.size();
+  changed_.clear();
+}
+
+// Objects are indexed mostly in order of names, so they are appended
+void TopObjectStorage::indexProp(const Property& p, UnifiedObject * obj)
+{
+  vector<UnifiedObject*> & objects = indexes_[p.type()][p.key()];
+  auto it = objects.end();
+  if (!objects.empty() && UnifiedObject::nameLess(obj, objects.back()))
+    it = lower_bound(objects.begin(), objects.end(), obj, UnifiedObject::nameLess);
+  objects.insert(it, obj);
+}
+
+void TopObjectStorage::unindexProp(const Property& p, UnifiedObject * obj)
+{
+  auto indexIt = indexes_.find(p.type());
+  if (indexIt == indexes_.end())
+    return;
+  PropIndex & index = indexIt->second;
+  auto it = index.find(p.key());
+  if (it == index.end())
+    return;
+  vector<UnifiedObject*> & objects = it->second;
+  auto objIt = lower_bound(objects.begin(), objects.end(), obj, UnifiedObject::nameLess);
+  if (objIt != objects.end() && *objIt == obj)
+    objects.erase(objIt);
+  if (objects.empty())
+    index.erase(it);
+}
+
+const vector<UnifiedObject*> & TopObjectStorage::find(PropType pt, const PropKey & key) const
+{
+  static const vector<UnifiedObject*> empty;
+  auto it = indexes_.find(pt);
+  if (it == indexes_.end())
+    return empty;
+  auto objIt = it->second.find(key);
+  return objIt != it->second.end() ? objIt->second : empty;
+}
+
+vector<UnifiedObject*> TopObjectStorage::findRange(PropType pt, const PropKey & from, const PropKey & to) const
+{
+  const auto serialized = [](const PropKey & key) { return holds_alternative<vector<uint8_t>>(key); };
+  if (serialized(from) || serialized(to))
+    throw ErrorCode(1278);
+  vector<UnifiedObject*> res;
+  auto it = indexes_.find(pt);
+  if (it == indexes_.end())
+    return res;
+  const PropIndex & index = it->second;
+  if (!index.empty() && serialized(index.begin()->first))
+    throw ErrorCode(1278);
+  for (auto objIt = index.lower_bound(from); objIt != index.end() && objIt->first < to; ++objIt)
+    res.insert(res.end(), objIt->second.begin(), objIt->second.end());
+  return res;
+}
+
+// Objects of the storages are not referenced by the changed objects list, it is empty after initChanged()
+void TopObjectStorage::compactPending()
+{
+  for (ObjectStorage * storage : compact_)
+  {
+    storage->compactPending_ = false;
+    if (storage->deleted_ >= CompactMinDeleted && storage->deleted_ * 2 >= storage->objects_.size())
+      reclaimed_ += storage->compact(false);
+  }
+  compact_.clear();
+}
+
+void TopObjectStorage::pushApplied(TrzPtr trz, unique_ptr<TrzUndo> undo)
+{
+  applied_.push_back({ trz, move(undo) });
+  if (applied_.size() > MaxUndoDepth)
+    applied_[applied_.size() - MaxUndoDepth - 1].undo_.reset();
+}
 
-  for (UnifiedObject& obj : objects(true))
-    obj.initIfChangedAndClearState();
+// Packed tranzactions are undone by rebuilding, so deleted objects aren't needed anymore
+void TopObjectStorage::historyPacked()
+{
+  applied_.clear();
+  if (TrzHub * h = hub())
+    for (const TrzPtr& trz : h->tranzactions())
+      if (trz->created() <= h->current() && trz->enabled())
+        applied_.push_back({ trz, nullptr });
+  reclaimed_ += compact(true);
+}
+
+bool TopObjectStorage::documentInfo(DocumentInfo & info) const
+{
+  const DocStorageInfo * obj = findObject<DocStorageInfo>();
+  if (!obj)
+    return false;
+  info.title_ = obj->title();
+  info.tags_ = obj->tags();
+  return true;
+}
+
+// Inserted documents are synchronized by their own hubs, so they cannot be restored from the state
+bool TopObjectStorage::snapshot(Writer& w) const
+{
+  if (hasDocuments())
+    return false;
+  writeState(w);
+  return true;
 }
 
 bool TopObjectStorage::connecting(DocId docId, vector<TrzPtr> & trzs, datetime_t & current)
@@ -232,22 +697,23 @@ bool TopObjectStorage::connecting(DocId docId, vector<TrzPtr> & trzs, datetime_t
 }
 
 
-void TopObjectStorage::applyWithoutInit(TrzPtr trz)
+void TopObjectStorage::applyWithoutInit(TrzPtr trz, TrzUndo* undo)
 {
 
-  sort(trz->changes_.begin(), trz->changes_.end(), [](const ObjectChanges* c0, const ObjectChanges* c1)
-    {
-      return c0->objName().size() < c1->objName().size();
-    });
+  trz->sortByDepth();
 
-  for (const ObjectChanges * chgs : trz->changes_)
+  for (const ObjectChanges * chgs : trz->changes())
     if (ObjTypeUnchanged != chgs->objType() && ObjTypeDeleted != chgs->objType())
     {
       if (ObjectStorage * storage = findStorageOf(chgs->objName()))
-        storage->create(chgs->objType(), chgs->objName().back());
+      {
+        UnifiedObject * obj = storage->create(chgs->objType(), chgs->objName().back());
+        if (undo)
+          undo->keepCreated(*obj);
+      }
     }
 
-  for (const ObjectChanges * chgs : trz->changes_)
+  for (const ObjectChanges * chgs : trz->changes())
     if (UnifiedObject* obj = findObject(chgs->objName()))
       for (const PropPtr value : chgs->props())
         if (value->type() == DocIdProp::typeId_) 
@@ -255,9 +721,9 @@ void TopObjectStorage::applyWithoutInit(TrzPtr trz)
             if (TopObjectStorage* document = storage->isDocument()) 
               document->inserted(static_pointer_cast<DocIdProp>(value)->value());
 
-  for (const ObjectChanges * chgs : trz->changes_)
+  for (const ObjectChanges * chgs : trz->changes())
     if (UnifiedObject * obj = findObject(chgs->objName())) 
-      obj->change(*chgs);
+      obj->change(*chgs, undo);
 }
 
 
@@ -298,16 +764,23 @@ void TopObjectStorage::notify(TrzPtr trz)
   if (!trz->enabled())
     return;
 
-  applyWithoutInit(trz);
-
-
-  for (UnifiedObject& obj : objects(true))
-    obj.initIfChangedAndClearState();
-
+  // Tranzaction may be applied again with additional changes, its undo keeps the initial values
+  if (applied_.empty() || applied_.back().trz_ != trz)
+    pushApplied(trz, unique_ptr<TrzUndo>(new TrzUndo));
 
+  try
+  {
+    applyWithoutInit(trz, applied_.back().undo_.get());
+  }
+  catch (const std::exception&)
+  {
+    applied_.clear(); // partially applied, rebuild on the next setTranzactions()
+    throw;
+  }
 
 
-///  initObjects(objs);
+  initChanged();
+  compactPending();
 }
 
 
@@ -21,9 +21,13 @@ public:
   UnifiedObject * findObjectByName(ObjName) const; 
   UnifiedObject * findObject(const LongName &) const;
 
+  // The first existing object of the type by name
   UnifiedObject * findObjectByType(ObjType) const; 
   template<class ObjTypeName> inline ObjTypeName * findObject() const { return static_cast<ObjTypeName*>(findObjectByType(ObjTypeName::typeId_)); }
 
+  // Existing objects of the type sorted by name, nested storages are not included
+  const vector<UnifiedObject*> & objectsOfType(ObjType) const;
+
 
   ObjectStorage * findStorageOf(const LongName & name) const;
 
@@ -36,32 +40,55 @@ public:
   string debugString() const;
   void save(Writer&, bool onlySelected) const; 
 
+  // Objects tree with deleted objects and reserved names, used by TrzSnapshot
+  void writeState(Writer&) const;
+  void readState(Reader&);
+
   size_t size(bool withChildren) const noexcept;
 
+  // Depth-first walk over objects, nested storages are entered after their owners when withChildren.
+  // The top level may be restricted to a range, so a tree-wide pass can be split to parts.
   struct IterContainer 
   {
     struct Iter 
     {
-      const IterContainer & container_;
-      size_t pos_;
-
-      bool operator!= (const Iter& other) const { return pos_ != other.pos_; }
-      const Iter& operator++ () { pos_++; return *this; }
-      UnifiedObject & operator* () const
+      // Position in every storage from the top one to the current
+      struct Level
+      {
+        const vector<UnifiedObject*> * objects_;
+        size_t pos_;
+      };
+      vector<Level> stack_;
+      size_t end_;
+      bool withChildren_;
+      bool skipChildren_ = false;
+
+      bool operator!= (const Iter& other) const
       {
-        UnifiedObject & obj = *container_.objects_[pos_];
-        if (container_.withChildren_)
-          if (ObjectStorage * storage = obj.isStorage())
-          { } 
-        return obj;
+        return stack_.size() != other.stack_.size() || (!stack_.empty() && stack_.back().pos_ != other.stack_.back().pos_);
       }
+      const Iter& operator++ ();
+      UnifiedObject & operator* () const { return *(*stack_.back().objects_)[stack_.back().pos_]; }
+
+      // Nesting level of the current object, 0 for objects of the iterated storage
+      inline size_t depth() const { return stack_.size() - 1; }
+
+      // Don't enter the nested storage of the current object
+      inline void skipChildren() { skipChildren_ = true; }
     };
 
-    explicit IterContainer(const vector<UnifiedObject*> & objects, bool withChildren) : objects_(objects), withChildren_(withChildren) {}
-    Iter begin() const { return{ *this, 0 }; }
-    Iter end() const { return{ *this, objects_.size() }; }
+    IterContainer(const vector<UnifiedObject*> & objects, bool withChildren, size_t begin = 0, size_t end = SIZE_MAX)
+      : objects_(objects), withChildren_(withChildren), begin_(begin), end_(min(end, objects.size())) {}
+    Iter begin() const;
+    Iter end() const { return{ {}, end_, withChildren_ }; }
+
+    // Split the top level objects to parts of nearly equal count, the parts may be walked in parallel
+    vector<IterContainer> split(size_t parts) const;
+
     const vector<UnifiedObject*> & objects_;
     bool withChildren_;
+    size_t begin_;
+    size_t end_;
   };
   IterContainer objects(bool withChildren) const { return IterContainer(objects_, withChildren); }
 
@@ -75,14 +102,57 @@ public:
 
   inline ObjName reserveName() { return nextName_++; }
 
+  // Free deleted objects, return estimated count of freed bytes. Names of freed objects stay reserved by
+  // nextName_, deleted storages with objects and inserted documents are kept.
+  size_t compact(bool withChildren);
+
+  inline size_t deletedCount() const { return deleted_; }
+
+  // Changed when objects of the storages tree are created, deleted or freed, links resolved before are
+  // resolved again. The epoch belongs to the top storage of the tree, so independent documents don't
+  // share it. Its values are unique among all trees, so a cache made in another tree never matches.
+  inline uint64_t linksEpoch() const { return *rootEpoch_; }
+
+  // The document compacts the storage after the tranzaction when it has at least this count of deleted
+  // objects and they are at least half of objects
+  static constexpr size_t CompactMinDeleted = 1024;
+
 protected:
   ObjName nextName_ = 1;
 
+  size_t deleted_ = 0;
+  bool compactPending_ = false;
+
+  uint64_t linksEpoch_ = nextLinksEpoch_++;
+  static atomic<uint64_t> nextLinksEpoch_;
+  // Epoch of the top storage of the tree, nested storages get it from their parent when they are created
+  uint64_t * rootEpoch_ = &linksEpoch_;
+  inline void linksChanged() { *rootEpoch_ = nextLinksEpoch_++; }
+
+  friend class UnifiedObject;
+  friend class TopObjectStorage;
+  void objectDeleted();
+
+  // Existing objects by type sorted by name, updated when objects are created and deleted
+  map<ObjType, vector<UnifiedObject*>> byType_;
+  void addToTypeIndex(UnifiedObject*);
+  // Objects deleted by one cascade are removed from the indexes of their storages at once
+  static void removeFromTypeIndexes(vector<UnifiedObject*> deleted);
+
   void clear();
 
   vector<UnifiedObject*> objects_;
 
+  // Memory of the objects, it belongs to the document and is shared by its nested storages.
+  // A storage created apart from a document allocates its own arena with the first object.
+  ObjectArena * arena_ = nullptr;
+  unique_ptr<ObjectArena> ownArena_;
+  UnifiedObject * createObject(ObjType);
+
   vector<UnifiedObject*>::const_iterator findObjectIterator(ObjName) const;
+
+  void restoreLinks();
+  bool hasDocuments() const;
 };
 
 
@@ -91,6 +161,8 @@ protected:
 class TopObjectStorage : public ObjectStorage, public TrzIO
 {
 public:
+  TopObjectStorage() { arena_ = &documentArena_; }
+  ~TopObjectStorage();
 
   DocId docId() const { return docId_; }
   inline UserId userId() const { return static_cast<UserId>(docId_ >> 32); }
@@ -105,13 +177,72 @@ public:
 
   void setTranzactions(DocId, const vector<TrzPtr> & trsz, datetime_t current) override;
 
+  bool snapshot(Writer&) const override;
+
+  void historyPacked() override;
+
+  bool documentInfo(DocumentInfo&) const override;
+
   void initDocument();
   void initUserProfile(UserId);
 
+  // Undo/redo reverts only this count of the latest tranzactions incrementally, older ones rebuild the document
+  static constexpr size_t MaxUndoDepth = 100;
+
+  // Count of objects initialized after changes, the work per tranzaction is proportional to it
+  inline size_t initializedCount() const { return initialized_; }
+
+  // Count of bytes returned to the heap by compaction of deleted objects, the arena keeps their memory for new objects
+  inline size_t reclaimedBytes() const { return reclaimed_; }
+
+  // Memory allocated for objects of the document and nested storages
+  inline size_t objectsCapacity() const { return documentArena_.capacity(); }
+
+  // Objects of the document and nested storages having the SEARCHABLE property with the value, ordered by long names
+  const vector<UnifiedObject*> & find(PropType, const PropKey&) const;
+
+  // Objects having the SEARCHABLE property with the value in [from, to), ordered by the value and long names.
+  // Only integer and string values have ranges.
+  vector<UnifiedObject*> findRange(PropType, const PropKey& from, const PropKey& to) const;
+
 protected:
-  void applyWithoutInit(TrzPtr);
+  void applyWithoutInit(TrzPtr, TrzUndo* undo = nullptr);
 
   DocId docId_ = 0;
+
+private:
+  // Tranzactions the document state consists of, in order of applying
+  struct Applied
+  {
+    TrzPtr trz_;
+    unique_ptr<TrzUndo> undo_;
+  };
+  vector<Applied> applied_;
+
+  // Objects are destroyed before the arena, so the destructor clears the document
+  ObjectArena documentArena_;
+
+  // Objects changed since the latest initChanged(), including objects of nested storages
+  friend class UnifiedObject;
+  vector<UnifiedObject*> changed_;
+  size_t initialized_ = 0;
+  void initChanged();
+
+  // Indexes of SEARCHABLE properties by type, objects having the value are ordered by long names
+  using PropIndex = map<PropKey, vector<UnifiedObject*>>;
+  unordered_map<PropType, PropIndex> indexes_;
+  void indexProp(const Property&, UnifiedObject*);
+  void unindexProp(const Property&, UnifiedObject*);
+
+  // Storages of the document to compact after the tranzaction
+  friend class ObjectStorage;
+  vector<ObjectStorage*> compact_;
+  size_t reclaimed_ = 0;
+  void compactPending();
+
+  void pushApplied(TrzPtr, unique_ptr<TrzUndo>);
+  bool revertTo(size_t count);
+  void rebuild(const vector<TrzPtr> & trzs, datetime_t current);
 };
 
 
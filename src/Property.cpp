@@ -5,6 +5,13 @@ class UnifiedObject;
 
 DefinitionRegistry<Property::Definition> Property::propDefs_;
 
+PropKey Property::key() const
+{
+  CborMemWriter w;
+  write(w);
+  return vector<uint8_t>(w.data().begin(), w.data().end());
+}
+
 
 
 
@@ -24,44 +24,76 @@ enum PROP_FLAGS
 
 
 
+// Definitions sorted by id. Small ids are also indexed by the dense table, so get() is O(1) and
+// doesn't allocate; ids above DenseIdLimit are found by binary search.
 template <class DefType>
 class DefinitionRegistry : public vector<unique_ptr<DefType>>
 {
 public:
+  static constexpr int DenseIdLimit = 4096;
 
   template<class CreateFn> 
-  void add(int id, int flags, const string& name, CreateFn fn)
+  DefType& add(int id, int flags, const string& name, CreateFn fn)
   {
-    unique_ptr<DefType> newDefinition = make_unique<DefType>(id, flags, name, fn);
-
-    auto it = find_if(begin(*this), end(*this), [&](const unique_ptr<DefType>& a) { return a->name_ == newDefinition->name_; });
-    if (it != end(*this))
+    if (names_.count(name))
       throw ErrorCode(DuplicatedObjectName);
-    it = lower_bound(begin(*this), end(*this), newDefinition,
-      [](const unique_ptr<DefType>& a, const unique_ptr<DefType>& b) { return a->id_ < b->id_; });
+    auto it = lower_bound(begin(*this), end(*this), id,
+      [](const unique_ptr<DefType>& a, int id) { return a->id_ < id; });
     if (it != end(*this))
-      if ((*it)->id_ == newDefinition->id_)
+      if ((*it)->id_ == id)
         throw ErrorCode(DuplicatedObjectId);
+
+    unique_ptr<DefType> newDefinition = make_unique<DefType>(id, flags, name, fn);
+    DefType* def = newDefinition.get();
     vector<unique_ptr<DefType>>::insert(it, move(newDefinition));
+    names_.emplace(name, def);
+    if (0 <= id && id < DenseIdLimit)
+    {
+      if (byId_.size() <= size_t(id))
+        byId_.resize(id + 1, nullptr);
+      byId_[id] = def;
+    }
+    return *def;
   }
 
-  const DefType& get(int pt) 
-  {                                 
-    auto tmp = make_unique<DefType>(pt);
-    auto it = lower_bound(begin(*this), end(*this), tmp,
-      [](const unique_ptr<DefType>& a, const unique_ptr<DefType>& b) { return a->id_ < b->id_; });
-    if (it == end(*this))
-      throw ErrorCode(UnknownObjType); 
-    if ((*it)->id_ != pt)
+  inline const DefType& get(int id) const
+  {
+    if (size_t(id) < byId_.size())
+    {
+      if (const DefType* def = byId_[id])
+        return *def;
       throw ErrorCode(UnknownObjType);
-    return *(it->get());
+    }
+    return getSparse(id);
   }
 
-  static const DefType* findByName(const string&); 
+  // Return nullptr if the name isn't registered
+  const DefType* findByName(const string& name) const
+  {
+    auto it = names_.find(name);
+    return it != names_.end() ? it->second : nullptr;
+  }
+
+private:
+  vector<const DefType*> byId_;
+  map<string, const DefType*, less<>> names_;
+
+  const DefType& getSparse(int id) const
+  {
+    auto it = lower_bound(begin(*this), end(*this), id,
+      [](const unique_ptr<DefType>& a, int id) { return a->id_ < id; });
+    if (it == end(*this) || (*it)->id_ != id)
+      throw ErrorCode(UnknownObjType);
+    return *(it->get());
+  }
 };
 
 
 
+// Value of a property in indexes of SEARCHABLE properties, integers and strings are ordered by value.
+// Other values are indexed by their serialized bytes, so they are found by equality only.
+using PropKey = variant<int64_t, string, vector<uint8_t>>;
+
 class Property  
 {
 public:
@@ -71,7 +103,9 @@ public:
     int id_;
     int flags_; 
     string name_;
-    function<Property* (Reader&)> creator_;
+    // Read values are allocated together with the reference counter of PropPtr
+    function<shared_ptr<Property> (Reader&)> creator_;
+    function<shared_ptr<Property> (CborReader&)> cborCreator_; // the same without virtual calls of the reader
 
     bool inline searchable() const { return 0 != (SEARCHABLE & flags_); }
     bool inline readonly() const { return 0 != (READONLY & flags_); }
@@ -83,7 +117,9 @@ public:
   template<class T>
   static void addPropertyDefinition(const string& name, int flags)
   {
-    propDefs_.add<function<Property* (Reader&)>>(T::typeId_, flags, name, [](Reader& r) {return new T(r); });
+    Definition& def = propDefs_.add<function<shared_ptr<Property> (Reader&)>>(T::typeId_, flags, name,
+      [](Reader& r) { return shared_ptr<Property>(make_shared<T>(r)); });
+    def.cborCreator_ = [](CborReader& r) { return shared_ptr<Property>(make_shared<T>(r)); };
   }
 
 
@@ -93,6 +129,9 @@ public:
 
   virtual void write(Writer&) const = 0;
 
+  // Properties without their own key are indexed by the serialized value
+  virtual PropKey key() const;
+
   virtual void putInto(UnifiedObject*) {}
 
   virtual void removeFrom(UnifiedObject*) {}
@@ -127,12 +166,13 @@ public:
   const Definition& def() const override { static const Definition* d; return *(d ? d : d = &Property::propDefs_.get(PT)); }
 
   explicit PropValueTemplate(ValueType value) : value_(value) {}
-  explicit PropValueTemplate(Reader& r) : value_(r.getInt<ValueType>()) { }
+  template <ReaderType R> explicit PropValueTemplate(R& r) : value_(r.template getInt<ValueType>()) { }
 
 
 
 
   void write(Writer& w) const override { w.save<ValueType>(value_); }
+  PropKey key() const override { return static_cast<int64_t>(value_); }
   inline ValueType value() const { return value_; }
 
 protected:
@@ -149,10 +189,12 @@ template <PropType PT>
 class PropValueTemplate<PT, string> : public Property
 {
 public:
-  static constexpr PropType id_ = PT;
-  explicit PropValueTemplate(const string & value) : Property(PT), value_(value) {}
-  explicit PropValueTemplate(Reader & r) : Property(PT), value_(r.getStr()) { }
-  void write(Writer & w) const override { w.save(value_); }
+  static constexpr PropType typeId_ = PT;
+  const Definition& def() const override { static const Definition* d; return *(d ? d : d = &Property::propDefs_.get(PT)); }
+  explicit PropValueTemplate(const string & value) : value_(value) {}
+  template <ReaderType R> explicit PropValueTemplate(R & r) : value_(r.getStr()) { }
+  void write(Writer & w) const override { w.putStr(value_); }
+  PropKey key() const override { return value_; }
   inline const string & value() const { return value_; }
 
 protected:
@@ -170,6 +212,11 @@ using DocIdProp = PropValueTemplate<1, DocId>;
 
 using UserIdProp = PropValueTemplate<2, UserId>;
 
+// Document title and comma separated tags, properties of DocStorageInfo
+using TitleProp = PropValueTemplate<3, string>;
+
+using TagsProp = PropValueTemplate<4, string>;
+
 
 #endif
 
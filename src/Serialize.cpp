@@ -3,6 +3,13 @@
 
 #include "Serialize.h"
 #include <cstring>
+#include <cstdio>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#endif
 
 #include "../json/single_include/nlohmann/json.hpp"
 using namespace nlohmann;
@@ -52,6 +59,46 @@ void Reader::skip()
   }
 }
 
+// Copy current element with all nested children array/map to the writer
+void Reader::copy(Writer& w)
+{
+  switch (nextDataType())
+  {
+    case DataType::Int:
+      w.putInt(getInt<int64_t>());
+      break;
+    case DataType::Real:
+      w.putReal(getReal());
+      break;
+    case DataType::String:
+      w.putStr(getStr());
+      break;
+    case DataType::Null:
+      getNull();
+      w.putNull();
+      break;
+    case DataType::Array:
+    {
+      size_t size = getArray();
+      w.putArray(size);
+      while (size--)
+        copy(w);
+      break;
+    }
+    case DataType::Map:
+    {
+      size_t size = getMap();
+      w.putMap(size);
+      while (size--)
+      {
+        copy(w);
+        copy(w);
+      }
+      break;
+    }
+  }
+}
+
 void Reader::getArray(size_t expectedSize)
 {
   if (getArray() != expectedSize)
@@ -71,49 +118,23 @@ string Reader::getStr()
   return str;
 }
 
-void MSItem::setStr(const char* str)
-{
-  char* s = new char[strlen(str) + 1];
-  strcpy(s, str);
-  str_ = s;
-}
-
-MSItem::MSItem(MSItem&& other) : type_(other.type_)
-{
-  switch (type_)
-  {
-    case Reader::DataType::String: str_ = other.str_; other.str_ = nullptr; break;
-    case Reader::DataType::Int: int_ = other.int_; break;
-    case Reader::DataType::Real: real_ = other.real_; break;
-    case Reader::DataType::Null:
-    case Reader::DataType::Array:
-    case Reader::DataType::Map: size_ = other.size_; break;
-  }
-}
-
-MSItem::MSItem(const MSItem& other) : type_(other.type_)
+Reader::Record Reader::getRecord()
 {
-  switch (type_)
-  {
-    case Reader::DataType::String: setStr(other.str_); break;
-    case Reader::DataType::Int: int_ = other.int_; break;
-    case Reader::DataType::Real: real_ = other.real_; break;
-    case Reader::DataType::Null:
-    case Reader::DataType::Array:
-    case Reader::DataType::Map: size_ = other.size_; break;
-  }
+  getArray(3);
+  Record res;
+  res.length_ = getInt<uint64_t>();
+  res.created_ = getInt<int64_t>();
+  return res;
 }
 
-MSItem::~MSItem()
+void Writer::beginRecord(int64_t created)
 {
-  if (Reader::DataType::String == type_)
-    delete str_;
+  putArray(3);
+  putInt(0);
+  putInt(created);
 }
 
-
-using MSDataT = vector<MSItem>;
-
-MSReader::MSReader(const MSDataT& data) : data_(data), ptr_(data.begin())
+MSReader::MSReader(const MSDataT& data) : data_(data), ptr_(data.items_.begin())
 {
   if (data_.empty())
     throw ErrorCode(SerializationInternalError); 
@@ -121,7 +142,7 @@ MSReader::MSReader(const MSDataT& data) : data_(data), ptr_(data.begin())
 
 Reader::DataType MSReader::nextDataType() const
 {
-  if (ptr_ == data_.end())
+  if (ptr_ == data_.items_.end())
     throw ErrorCode(SerializationInternalError);
   return ptr_->type_;
 }
@@ -129,33 +150,41 @@ Reader::DataType MSReader::nextDataType() const
 void MSReader::load(int64_t& i)
 {
   ensureType(DataType::Int);
-  i = ptr_->int_;
+  i = ptr_->get<int64_t>();
   ++ptr_;
 }
 
 void MSReader::load(string& str)
+{
+  str = getStrView();
+}
+
+string_view MSReader::getStrView()
 {
   ensureType(DataType::String);
-  str = ptr_->str_;
-  ++ptr_;
+  const MSItem & item = *(ptr_++);
+  if (item.inline_)
+    return string_view(item.chars(), item.inline_ - 1);
+  const uint64_t ref = item.get<uint64_t>();
+  return string_view(data_.strings_.data() + static_cast<uint32_t>(ref), static_cast<size_t>(ref >> 32));
 }
 
 double MSReader::getReal()
 {
   ensureType(DataType::Real);
-  return (ptr_++)->real_;
+  return (ptr_++)->get<double>();
 }
 
 size_t MSReader::getArray()
 {
   ensureType(DataType::Array);
-  return (ptr_++)->size_;
+  return static_cast<size_t>((ptr_++)->get<uint64_t>());
 }
 
 size_t MSReader::getMap()
 {
   ensureType(DataType::Map);
-  return (ptr_++)->size_;
+  return static_cast<size_t>((ptr_++)->get<uint64_t>());
 }
 
 void MSReader::getNull()
@@ -164,6 +193,13 @@ void MSReader::getNull()
   ++ptr_;
 }
 
+void MSReader::skipRecord(const Record& rec)
+{
+  if (rec.length_ > size_t(data_.items_.end() - ptr_))
+    throw ErrorCode(SerializationFormatError);
+  ptr_ += rec.length_;
+}
+
 void MSReader::ensureType(DataType type) const
 {
   if (type != nextDataType())
@@ -176,37 +212,60 @@ MSWriter::MSWriter(MSDataT& data) : data_(data)
 
 void MSWriter::putInt(int64_t i)
 {
-  data_.emplace_back(Reader::DataType::Int);
-  data_.back().int_ = i;
+  data_.items_.emplace_back(Reader::DataType::Int, i);
 }
 
 void MSWriter::putReal(double d)
 {
-  data_.emplace_back(Reader::DataType::Real);
-  data_.back().real_ = d;
+  data_.items_.emplace_back(Reader::DataType::Real, 0);
+  data_.items_.back().set(d);
 }
 
 void MSWriter::putStr(const string& str)
 {
-  data_.emplace_back(Reader::DataType::String);
-  data_.back().setStr(str.c_str());
+  if (str.size() <= MSItem::InlineSize)
+  {
+    MSItem & item = data_.items_.emplace_back(Reader::DataType::String, 0);
+    item.inline_ = static_cast<uint8_t>(str.size() + 1);
+    memcpy(item.chars(), str.data(), str.size());
+    return;
+  }
+  const size_t offset = data_.strings_.size();
+  if (offset + str.size() > UINT32_MAX)
+    throw ErrorCode(SerializationInternalError);
+  data_.strings_.insert(data_.strings_.end(), str.begin(), str.end());
+  data_.items_.emplace_back(Reader::DataType::String, offset | uint64_t(str.size()) << 32);
 }
 
 void MSWriter::putArray(size_t size)
 {
-  data_.emplace_back(Reader::DataType::Array);
-  data_.back().size_ = size;
+  data_.items_.emplace_back(Reader::DataType::Array, size);
 }
 
 void MSWriter::putMap(size_t size)
 {
-  data_.emplace_back(Reader::DataType::Map);
-  data_.back().size_ = size;
+  data_.items_.emplace_back(Reader::DataType::Map, size);
 }
 
 void MSWriter::putNull()
 {
-  data_.emplace_back(Reader::DataType::Null);
+  data_.items_.emplace_back(Reader::DataType::Null, 0);
+}
+
+void MSWriter::beginRecord(int64_t created)
+{
+  if (record_ != SIZE_MAX)
+    throw ErrorCode(SerializationInternalError);
+  putArray(3);
+  record_ = data_.items_.size();
+  putInt(0);
+  putInt(created);
+}
+
+void MSWriter::endRecord()
+{
+  data_.items_[record_].set<uint64_t>(data_.items_.size() - record_ - 2);
+  record_ = SIZE_MAX;
 }
 
 Reader* MSWriter::getBackReader()
@@ -336,10 +395,10 @@ void JsonWriter::writeBack()
 
   void CborReader::load(int64_t& i)  
   {
-    if (!isInt())
+    // Major type is decoded once, 0 for positive and 0x20 for negative integers
+    const uint8_t negative = majorType();
+    if (negative > 0x20)
       throw ErrorCode(SerializationFormatError);
-
-    const auto negative = 0x20 & peekByte();
     const uint64_t value = additionalInfo();
 
     if (negative)
@@ -358,16 +417,22 @@ void JsonWriter::writeBack()
 
   void CborReader::load(string& str)
   {
-    if (!isStr())
+    if (majorType() != 0x60)
       throw ErrorCode(SerializationFormatError);
 
-    int64_t i = additionalInfo();
+    size_t size = additionalInfo();
+    size_t pos = str.size();
+    str.resize(pos + size);
 
-    str.reserve(i);
-
-    while (i--)
+    while (size)
     {
-      str.push_back(getByte());
+      if (ptr_ == end_ && !nextBlock())
+        throw ErrorCode(SerializationFormatError);
+      const size_t count = min(size, size_t(end_ - ptr_));
+      memcpy(&str[pos], ptr_, count);
+      ptr_ += count;
+      pos += count;
+      size -= count;
     }
   }
 
@@ -391,7 +456,7 @@ void JsonWriter::writeBack()
 
   double CborReader::getReal()
   {
-    if (!isReal())
+    if (peekByte() != 0xfa && peekByte() != 0xfb)
       throw ErrorCode(SerializationFormatError);
 
     uint8_t chars[8];
@@ -425,23 +490,23 @@ void JsonWriter::writeBack()
 
   size_t CborReader::getArray()
   {
-    if (!isArray())
+    if (majorType() != 0x80)
       throw ErrorCode(SerializationFormatError);
     return additionalInfo();
   }
 
   size_t CborReader::getMap()
   {
-    if (!isMap())
+    if (majorType() != 0xA0)
       throw ErrorCode(SerializationFormatError);
     return additionalInfo();
   }
 
   void CborReader::getNull()
   {
-    if (!isNull())
+    if (peekByte() != (0xE0 | 22))
       throw ErrorCode(SerializationFormatError);
-    getByte(); 
+    getByte();
   }
 
   uint8_t CborReader::majorType() const
@@ -452,6 +517,12 @@ void JsonWriter::writeBack()
   uint64_t CborReader::getBytes(size_t count)
   {
     uint64_t res = 0;
+    if (size_t(end_ - ptr_) >= count)
+    {
+      while (count--)
+        res = (res << 8) | *ptr_++;
+      return res;
+    }
     while (count--)
     {
       res = (res << 8) | getByte();
@@ -462,45 +533,86 @@ void JsonWriter::writeBack()
   
 
 
-  CborMemReader::CborMemReader(const vector<uint8_t>& data) : data_(data), ptr_(data.begin())
+  uint32_t fnvHash(uint32_t hash, const uint8_t* data, size_t size) noexcept
   {
-    if (data_.empty())
-      throw ErrorCode(SerializationInternalError); 
+    for (const uint8_t* end = data + size; data != end; ++data)
+      hash = (hash ^ *data) * 16777619u;
+    return hash;
   }
 
-
-  uint8_t CborMemReader::getByte()
+  bool CborReader::nextBlock() const
   {
-    uint8_t res = peekByte();
-    ptr_++;
+    hash_ = fnvHash(hash_, hashed_, end_ - hashed_);
+    const bool res = refill();
+    hashed_ = ptr_;
     return res;
   }
 
-  uint8_t CborMemReader::peekByte() const
+  // Checksum is stored as CBOR tag with 4 bytes value, it isn't included to the next checksum
+  void CborReader::checkChecksum()
   {
-    if (ptr_ == data_.end())
-      throw ErrorCode(SerializationFormatError);
-    return *ptr_;
+    hash_ = fnvHash(hash_, hashed_, ptr_ - hashed_);
+    hashed_ = ptr_;
+    const uint32_t expected = hash_;
+
+    if (!atEnd() && peekByte() == (0xC0 | 26))
+    {
+      getByte();
+      if (getBytes(4) != expected)
+        throw ErrorCode(SerializationChecksumError);
+    }
+    hash_ = FnvBasis;
+    hashed_ = ptr_;
   }
 
 
-  CborFileReader::CborFileReader(const filesystem::path& p)
-    : file_(p, ios_base::in | ios_base::binary)
+  void CborReader::skipRecord(const Record& rec)
   {
+    if (!rec.length_)
+    {
+      skip();
+      return;
+    }
+    // Skipped bytes are hashed by checkChecksum() and nextBlock() as decoded ones
+    for (uint64_t size = rec.length_; size; )
+    {
+      if (ptr_ == end_ && !nextBlock())
+        throw ErrorCode(SerializationFormatError);
+      const size_t count = size_t(min<uint64_t>(size, end_ - ptr_));
+      ptr_ += count;
+      size -= count;
+    }
   }
 
-  uint8_t CborFileReader::getByte()
+  CborMemReader::CborMemReader(const vector<uint8_t>& data)
+    : CborMemReader(data, 0, data.size())
   {
-    if (!file_.good())
-      throw ErrorCode(SerializationFileOpenError);
-    return file_.get();
   }
 
-  uint8_t CborFileReader::peekByte() const
+  CborMemReader::CborMemReader(const vector<uint8_t>& data, size_t begin, size_t end)
+    : data_(data.data())
+  {
+    if (begin >= end || end > data.size())
+      throw ErrorCode(SerializationInternalError); 
+    ptr_ = hashed_ = data_ + begin;
+    end_ = data_ + end;
+  }
+
+
+  CborFileReader::CborFileReader(const filesystem::path& p, size_t blockSize)
+    : file_(p, ios_base::in | ios_base::binary), buffer_(blockSize)
   {
-    if (!file_.good())
+  }
+
+  bool CborFileReader::refill() const
+  {
+    if (!file_.is_open())
       throw ErrorCode(SerializationFileOpenError);
-    return file_.peek();
+    file_.read(reinterpret_cast<char*>(buffer_.data()), buffer_.size());
+    const size_t count = static_cast<size_t>(file_.gcount());
+    ptr_ = buffer_.data();
+    end_ = ptr_ + count;
+    return count > 0;
   }
 
 
@@ -535,14 +647,15 @@ void JsonWriter::writeBack()
 
 
 
-  void CborMemWriter::putStr(const string& str)
+  void CborWriter::putStr(const string& str)
   {
     const size_t strLen = str.length();
     putHeader(strLen, 0x60);
     data_.insert(data_.end(), str.begin(), str.end());
+    written();
   }
 
-  void CborMemWriter::putReal(double value)
+  void CborWriter::putReal(double value)
   {
     data_.push_back(0xe0 | 27);
 
@@ -555,9 +668,50 @@ void JsonWriter::writeBack()
     data_.push_back(byteArray[2]);
     data_.push_back(byteArray[1]);
     data_.push_back(byteArray[0]);
+    written();
+  }
+
+  void CborWriter::updateHash()
+  {
+    hash_ = fnvHash(hash_, data_.data() + hashed_, data_.size() - hashed_);
+    hashed_ = data_.size();
   }
 
-  void CborMemWriter::putHeader(int64_t value, int mask)
+  void CborWriter::putChecksum()
+  {
+    updateHash();
+    data_.push_back(0xC0 | 26);
+    for (int shift = 24; shift >= 0; shift -= 8)
+      data_.push_back(static_cast<uint8_t>(hash_ >> shift));
+    hash_ = FnvBasis;
+    hashed_ = data_.size();
+    written();
+  }
+
+  // Length of the record is written as 4 bytes integer and patched when the record is complete
+  void CborWriter::beginRecord(int64_t created)
+  {
+    if (record_ != SIZE_MAX)
+      throw ErrorCode(SerializationInternalError);
+    putArray(3);
+    record_ = data_.size();
+    data_.insert(data_.end(), { 26, 0, 0, 0, 0 });
+    putInt(created);
+    recordBegin_ = data_.size();
+  }
+
+  void CborWriter::endRecord()
+  {
+    const size_t length = data_.size() - recordBegin_;
+    if (length > UINT32_MAX)
+      throw ErrorCode(SerializationInternalError);
+    for (size_t i = 1; i <= 4; i++)
+      data_[record_ + i] = static_cast<uint8_t>(length >> ((4 - i) * 8));
+    record_ = SIZE_MAX;
+    written();
+  }
+
+  void CborWriter::putHeader(int64_t value, int mask)
   {
     auto putBytes = [&](int64_t value, size_t count)
     {
@@ -591,80 +745,76 @@ void JsonWriter::writeBack()
       data_.push_back(0x1B | mask);
       putBytes(value, 8);
     }
+    written();
   }
   
 
-  CborFileWriter::CborFileWriter(const filesystem::path& p)
-    : file_(p, ios_base::out | ios_base::binary | ios_base::trunc)
+  CborFileWriter::CborFileWriter(const filesystem::path& p, bool append, bool sync)
+    : sync_(sync)
   {
+#ifdef _WIN32
+    file_ = _wfopen(p.c_str(), append ? L"ab" : L"wb");
+#else
+    file_ = fopen(p.c_str(), append ? "ab" : "wb");
+#endif
+    if (!file_)
+      throw ErrorCode(SerializationFileOpenError);
+    blockSize_ = DefaultBlockSize;
+    data_.reserve(blockSize_ + 64);
   }
 
   CborFileWriter::~CborFileWriter()
   {
-    file_.close();
-  }
-  
-  void CborFileWriter::putStr(const string& str)
-  {
-    const size_t strLen = str.length();
-    putHeader(strLen, 0x60);
-    file_.write(str.c_str(), strLen);
-  }
-
-  void CborFileWriter::putReal(double value)
-  {
-    uint8_t c = 0xe0 | 27;
-    file_.write((const char*)&c, 1);
-
-    char* byteArray = reinterpret_cast<char*>(&value);
-    file_.write(byteArray + 7, 1);
-    file_.write(byteArray + 6, 1);
-    file_.write(byteArray + 5, 1);
-    file_.write(byteArray + 4, 1);
-    file_.write(byteArray + 3, 1);
-    file_.write(byteArray + 2, 1);
-    file_.write(byteArray + 1, 1);
-    file_.write(byteArray + 0, 1);
-  }
-
-  void CborFileWriter::putHeader(int64_t value, int mask)
-  {
-    auto putBytes = [&](int64_t value, size_t count)
-    {
-      while (count--)
-      {
-        file_.put(static_cast<uint8_t>(value >> (count << 3)));
-      }
-    };
-
-    if (!file_.good())
-      throw ErrorCode(SerializationFileOpenError);
-
-    if (value <= 23)
-    {
-      file_.put(static_cast<uint8_t>(value | mask));
-    }
-    else if (value <= 0xff)
+    try
     {
-      file_.put(0x18 | mask);
-      file_.put(static_cast<uint8_t>(value));
+      flush();
     }
-    else if (value <= 0xffff)
+    catch (const ErrorCode&)
     {
-      file_.put(0x19 | mask);
-      putBytes(value, 2);
     }
-    else if (value <= 0xffff'ffff)
+    fclose(file_);
+  }
+
+  void CborFileWriter::flush()
+  {
+    if (!data_.empty())
     {
-      file_.put(0x1A | mask);
-      putBytes(value, 4);
+      updateHash();
+      hashed_ = 0;
+      const size_t size = data_.size();
+      const size_t written = fwrite(data_.data(), 1, size, file_);
+      data_.clear();
+      if (written != size)
+        throw ErrorCode(SerializationFileOpenError);
     }
-    else
+    if (fflush(file_) != 0)
+      throw ErrorCode(SerializationFileOpenError);
+    if (sync_)
     {
-      file_.put(0x1B | mask);
-      putBytes(value, 8);
+#ifdef _WIN32
+      if (_commit(_fileno(file_)) != 0)
+#else
+      if (fsync(fileno(file_)) != 0)
+#endif
+        throw ErrorCode(SerializationFileOpenError);
     }
+  }
 
+  // Windows has no fsync of directories, NTFS journals the rename itself
+  void CborFileWriter::syncDirectory(const filesystem::path& dir)
+  {
+#ifndef _WIN32
+    const int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+    if (fd < 0)
+      throw ErrorCode(SerializationFileOpenError);
+    const int res = fsync(fd);
+    close(fd);
+    if (res != 0)
+      throw ErrorCode(SerializationFileOpenError);
+#else
+    (void)dir;
+#endif
   }
 
 
+
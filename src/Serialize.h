@@ -8,7 +8,9 @@
 
 #include "Config.h"
 #include <fstream>
+#include <cstring>
 
+class Writer;
 
 class Reader
 {
@@ -16,7 +18,7 @@ public:
 
   virtual bool isBinaryFormat() const = 0;
 
-  enum class DataType { Int, Real, String, Null, Array, Map };
+  enum class DataType : uint8_t { Int, Real, String, Null, Array, Map };
   virtual DataType nextDataType() const = 0;
 
   inline bool isInt() const { return DataType::Int == nextDataType(); }
@@ -33,16 +35,37 @@ public:
   virtual size_t getArray() = 0;
   virtual size_t getMap() = 0;
 
+  // No more elements to read
+  virtual bool atEnd() const = 0;
+
   // Skip current element with all nested children array/map
   void skip();
 
+  // Copy current element with all nested children array/map to the writer
+  void copy(Writer&);
+
   virtual void startEncription(const string&) { throw ErrorCode(NotImplemented); }
 
+  // Verify checksum written by Writer::putChecksum(), throw SerializationChecksumError on mismatch.
+  // Data without checksum is accepted. Formats without checksums don't do anything.
+  virtual void checkChecksum() {}
+
   // Read array's header. Throw an exception in case the size mismatch.
   void getArray(size_t expectedSize);
 
   // Read map's header. Throw an exception in case the size mismatch.
   void getMap(size_t expectedSize);
+
+  // Header of a record written by Writer::beginRecord(), the content follows it
+  struct Record
+  {
+    uint64_t length_;
+    int64_t created_;
+  };
+  Record getRecord();
+
+  // Skip the content of the record by its length without decoding, formats without lengths decode it
+  virtual void skipRecord(const Record&) { skip(); }
   
 
 
@@ -66,6 +89,10 @@ public:
   virtual ~Reader() = default;
 };
 
+// Decoding templates are instantiated for a concrete reader, e.g. CborReader, to decode without virtual calls,
+// and for Reader as the fallback for any format
+template <class R> concept ReaderType = is_base_of_v<Reader, R>;
+
 
 class Writer
 {
@@ -93,6 +120,18 @@ public:
 
   virtual void startEncription(const string&) { throw ErrorCode(NotImplemented); }
 
+  // Write buffered data to the destination, errors are reported by exceptions here rather than in destructor
+  virtual void flush() {}
+
+  // Write checksum of data written since the previous checksum
+  virtual void putChecksum() {}
+
+  // Record is an array of the content length, the creation time and the content written between
+  // these calls. The length is in units of the format, e.g. bytes, so the reader skips the content
+  // without decoding. Formats without lengths write 0. Records aren't nested.
+  virtual void beginRecord(int64_t created);
+  virtual void endRecord() {}
+
 
 
 ///    if (sizeof(T) >= sizeof(int32_t))
@@ -123,27 +162,41 @@ public:
 
 
 
+// Item of in-memory serialized data, 16 bytes. Strings up to InlineSize bytes are stored in the item,
+// longer ones in the strings buffer of MSDataT, so items are trivially copyable and don't allocate.
 struct MSItem 
 {
-  const Reader::DataType type_;
-  explicit MSItem(Reader::DataType t) : type_(t) {}
-  union
-  {
-    int64_t int_;
-    double real_;
-    const char* str_ = nullptr;
-    size_t size_;
-  };
-  void setStr(const char* str);
-  
-  MSItem(MSItem&& other);
-  
-  MSItem(const MSItem& other);
-  
-  ~MSItem();
+  static constexpr size_t InlineSize = 14;
+
+  MSItem(Reader::DataType t, uint64_t value) : type_(t) { set(value); }
+
+  Reader::DataType type_;
+
+  // Length of the inline string plus one, 0 if the string is in the buffer
+  uint8_t inline_ = 0;
+
+  // Integer, bits of real, size of array or map, or offset and length of the string in the buffer
+  template <class T> inline T get() const { T t; memcpy(&t, data_ + ValueOffset, sizeof(T)); return t; }
+  template <class T> inline void set(T t) { memcpy(data_ + ValueOffset, &t, sizeof(T)); }
+
+  inline const char* chars() const { return data_; }
+  inline char* chars() { return data_; }
+
+private:
+  static constexpr size_t ValueOffset = 6;
+  char data_[InlineSize];
 };
+static_assert(sizeof(MSItem) == 16, "");
+
+// In-memory serialized data. It is moved or shared by reference without copying of strings.
+struct MSDataT
+{
+  vector<MSItem> items_;
+  vector<char> strings_;
 
-using MSDataT = vector<MSItem>;
+  inline bool empty() const { return items_.empty(); }
+  inline void clear() { items_.clear(); strings_.clear(); }
+};
 
 
 class MSReader : public Reader
@@ -166,10 +219,17 @@ public:
   size_t getMap();
   
   void getNull();
+
+  // The string stays valid while the data isn't changed
+  string_view getStrView();
+
+  void skipRecord(const Record&) override;
+
+  bool atEnd() const override { return ptr_ == data_.items_.end(); }
   
 protected:
   const MSDataT& data_;
-  MSDataT::const_iterator ptr_;
+  vector<MSItem>::const_iterator ptr_;
   void ensureType(DataType type) const;
   
 private:
@@ -199,8 +259,13 @@ public:
   
   Reader* getBackReader();
 
+  // Length of the record is the count of items
+  void beginRecord(int64_t created) override;
+  void endRecord() override;
+
 protected:
   MSDataT& data_;
+  size_t record_ = SIZE_MAX; // index of the length item of the open record
 
 private:
   MSWriter(const MSWriter&) = delete;
@@ -252,36 +317,86 @@ private:
 
 
 
+// Checksum used by CBOR reader and writer, 32 bit FNV-1a
+constexpr uint32_t FnvBasis = 2166136261u;
+uint32_t fnvHash(uint32_t hash, const uint8_t* data, size_t size) noexcept;
+
+
 class CborReader : public Reader
 {
 public:
 
   bool isBinaryFormat() const override { return true; }
 
-  DataType nextDataType() const override;
+  DataType nextDataType() const final;
   
-  void load(int64_t&) override;
+  void load(int64_t&) final;
   
-  void load(string&);
+  void load(string&) final;
   
   uint64_t additionalInfo();
   
-  double getReal();
+  double getReal() final;
   
-  size_t getArray();
+  size_t getArray() final;
   
-  size_t getMap();
+  size_t getMap() final;
   
-  void getNull();
+  void getNull() final;
+
+  // Reader methods calling the virtual ones are hidden by direct calls, so templates instantiated
+  // for CborReader are inlined into tight loops
+  template <typename IntT = int> inline IntT getInt() { int64_t i; CborReader::load(i); return static_cast<IntT>(i); }
+
+  template<typename T>
+  void getVector(vector<T>& v)
+  {
+    size_t size = CborReader::getArray();
+    v.reserve(size);
+    while (size--)
+      v.push_back(getInt<T>());
+  }
+
+  inline string getStr() { string str; CborReader::load(str); return str; }
+
+  bool atEnd() const override { return ptr_ == end_ && !nextBlock(); }
+
+  void checkChecksum() override;
+
+  void skipRecord(const Record&) override;
   
 protected:
 
   uint8_t majorType() const;
   
   uint64_t getBytes(size_t count);
-  
-  virtual uint8_t getByte() = 0;
-  virtual uint8_t peekByte() const = 0;
+
+  // Not decoded bytes are [ptr_, end_). When the range is exhausted refill() provides the next block
+  // and returns false at the end of data.
+  mutable const uint8_t* ptr_ = nullptr;
+  mutable const uint8_t* end_ = nullptr;
+
+  virtual bool refill() const { return false; }
+
+  inline uint8_t getByte()
+  {
+    const uint8_t res = peekByte();
+    ptr_++;
+    return res;
+  }
+
+  inline uint8_t peekByte() const
+  {
+    if (ptr_ == end_ && !nextBlock())
+      throw ErrorCode(SerializationFormatError);
+    return *ptr_;
+  }
+
+  // Checksum of bytes before hashed_ since the previous checksum
+  mutable uint32_t hash_ = FnvBasis;
+  mutable const uint8_t* hashed_ = nullptr;
+
+  bool nextBlock() const;
 };
 
 
@@ -290,32 +405,35 @@ class CborMemReader : public CborReader
 public:
 
   explicit CborMemReader(const vector<uint8_t>& data);
-  
-protected:
-  const vector<uint8_t>& data_;
-  vector<uint8_t>::const_iterator ptr_;
 
-  uint8_t getByte() override;
-  
-  uint8_t peekByte() const override;
+  // Read only the range [begin, end) of the data
+  CborMemReader(const vector<uint8_t>& data, size_t begin, size_t end);
+
+  // Offset of the next element from the data start
+  inline size_t position() const { return ptr_ - data_; }
   
 private:
+  const uint8_t* data_;
+
+
   CborMemReader(const CborMemReader&) = delete;
   void operator=(const CborMemReader&) = delete;
 };
 
 
+// Reads the file by large blocks, so decoding works on a memory range as CborMemReader does
 class CborFileReader : public CborReader
 {
 public:
-  explicit CborFileReader(const filesystem::path&);
+  static constexpr size_t DefaultBlockSize = 1 << 20;
+
+  explicit CborFileReader(const filesystem::path&, size_t blockSize = DefaultBlockSize);
   
 protected:
   mutable ifstream file_;
+  mutable vector<uint8_t> buffer_;
 
-  uint8_t getByte();
-  
-  uint8_t peekByte() const;
+  bool refill() const override;
   
 private:
   CborFileReader(const CborFileReader&) = delete;
@@ -336,9 +454,36 @@ public:
   void putArray(size_t size) override;
   
   void putMap(size_t size) override;
+
+  void putStr(const string& str) override;
+  
+  void putReal(double value) override;
+  
+  void putChecksum() override;
+
+  void beginRecord(int64_t created) override;
+  void endRecord() override;
   
 protected:
-  virtual void putHeader(int64_t value, int mask) = 0;
+  // Encoded data. It is flushed when the size reaches blockSize_ and no record is open, 
+  // the length of the record is written when the record is complete
+  vector<uint8_t> data_;
+  size_t blockSize_ = SIZE_MAX;
+  size_t record_ = SIZE_MAX; // offset of the length of the open record in data_
+  size_t recordBegin_ = 0;   // offset of the record content
+
+  // Checksum of data_ before hashed_ and all flushed data since the previous checksum
+  uint32_t hash_ = FnvBasis;
+  size_t hashed_ = 0;
+  void updateHash();
+
+  void putHeader(int64_t value, int mask);
+
+  inline void written()
+  {
+    if (data_.size() >= blockSize_ && record_ == SIZE_MAX)
+      flush();
+  }
 };
 
 
@@ -346,38 +491,35 @@ class CborMemWriter : public CborWriter
 {
 public:
   CborMemWriter() = default;
-
-  void putStr(const string& str) override;
-  
-  void putReal(double value) override;
   
   inline const vector<uint8_t>& data() const { return data_; }
 
-protected:
-  void putHeader(int64_t value, int mask) override;
-  
-  vector<uint8_t> data_;
 private:
   CborMemWriter(const CborMemWriter&) = delete;
   void operator=(const CborMemWriter&) = delete;
 };
 
 
+// Encodes to the memory and writes the file by large blocks
 class CborFileWriter : public CborWriter
 {
 public:
-  explicit CborFileWriter(const filesystem::path& p);
+  static constexpr size_t DefaultBlockSize = 1 << 20;
+
+  // Append mode keeps the file content and writes to the end of file,
+  // sync mode flushes the data to the disk, not only to the system cache
+  explicit CborFileWriter(const filesystem::path& p, bool append = false, bool sync = false);
 
   ~CborFileWriter();
-  
-  void putStr(const string& str) override;
-  
-  void putReal(double value) override;
+
+  void flush() override;
+
+  // Flush the directory entries to the disk, so a file renamed in the directory is kept after a crash
+  static void syncDirectory(const filesystem::path& dir);
   
 protected:
-  ofstream file_;
-
-  void putHeader(int64_t value, int mask) override;
+  FILE * file_ = nullptr;
+  bool sync_;
   
 private:
   CborFileWriter(const CborFileWriter&) = delete;
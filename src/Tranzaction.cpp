@@ -22,12 +22,54 @@ Tranzaction::Tranzaction(const LongName & source)
 {
 }
 
-Tranzaction::Tranzaction(Reader & r)
+Tranzaction::Tranzaction(Reader & r, ChangesFilter* filter)
 : active_(false)
 {
+  if (CborReader * cbor = dynamic_cast<CborReader*>(&r))
+    read(*cbor, filter);
+  else
+    read(r, filter);
+}
+
+// Changes are skipped, only flags used by TrzHub::updateDocumentVariants() are collected.
+// See ObjectChanges::write() for the format.
+Tranzaction::Tranzaction(CborMemReader & r, const shared_ptr<const vector<uint8_t>>& data)
+: active_(false),
+  lazy_(new LazyBody)
+{
+  lazy_->data_ = data;
+  lazy_->begin_ = r.position();
+
   size_t chgCount = r.getArray(); 
   created_ = r.getInt<datetime_t>(); 
 
+  if (chgCount % ObjectChanges::SerialSize > 1)
+    r.getVector(source_);
+
+  chgCount = chgCount / ObjectChanges::SerialSize;
+  while (chgCount--)
+  {
+    r.skip();
+    if (r.getInt<ObjType>() == ObjTypeDeleted)
+      lazy_->deleted_ = true;
+    r.skip();
+    for (size_t count = r.getMap(); count > 0; count--)
+    {
+      if (r.getInt<PropType>() == DocVariantProp::typeId_)
+        lazy_->variantProps_ = true;
+      r.skip();
+    }
+  }
+
+  lazy_->end_ = r.position();
+}
+
+template <ReaderType R>
+void Tranzaction::read(R & r, ChangesFilter* filter)
+{
+  size_t chgCount = r.getArray(); 
+  created_ = r.template getInt<datetime_t>(); 
+
   if (chgCount % ObjectChanges::SerialSize > 1)
     r.getVector(source_);
 
@@ -35,10 +77,46 @@ Tranzaction::Tranzaction(Reader & r)
   changes_.reserve(chgCount);
   while (chgCount--)
   {
-    changes_.push_back(new ObjectChanges(r));
+    if (!filter)
+    {
+      changes_.push_back(new ObjectChanges(r));
+      continue;
+    }
+
+    LongName name;
+    r.getVector(name);
+    const ObjType type = r.template getInt<ObjType>();
+    if (filter->accept(name, type))
+      changes_.push_back(new ObjectChanges(name, type, r));
+    else
+    {
+      r.skip(); 
+      r.skip(); 
+    }
   }
 }
 
+// If the data is damaged, the changes read so far are dropped and the next call throws again
+void Tranzaction::decode() const
+{
+  Tranzaction * self = const_cast<Tranzaction*>(this);
+  CborMemReader r(*lazy_->data_, lazy_->begin_, lazy_->end_);
+  self->source_.clear();
+  try
+  {
+    self->read(r, nullptr);
+  }
+  catch (const std::exception&)
+  {
+    for (ObjectChanges * ch : changes_)
+      delete ch;
+    changes_.clear();
+    self->source_.clear();
+    throw;
+  }
+  lazy_.reset();
+}
+
 TrzIO::~TrzIO()
 {
   if (hub_)
@@ -48,6 +126,12 @@ TrzIO::~TrzIO()
 // Tranzaction serialization
 void Tranzaction::write(Writer & w) const
 {
+  if (lazy_)
+  {
+    CborMemReader r(*lazy_->data_, lazy_->begin_, lazy_->end_);
+    r.copy(w);
+    return;
+  }
   w.putArray(changes_.size() * ObjectChanges::SerialSize + (source_.empty() ? 1 : 2)); 
   w.putInt(created_); 
   if (!source_.empty())
@@ -71,18 +155,12 @@ datetime_t Tranzaction::currentCreated()
 
 void Tranzaction::merge(const TrzPtr other)
 {
-  for (ObjectChanges * och : other->changes_)
+  changes();
+  for (ObjectChanges * och : other->changes())
   {
-    bool found = false;
-    for (ObjectChanges * ch : changes_)
-    {
-      if (ch->objName() == och->objName())
-      {
-        ch->merge(och);
-        found = true;
-      }
-    }
-    if (!found)
+    if (ObjectChanges * ch = findChanges(och->objName()))
+      ch->merge(och);
+    else
       changes_.push_back(och);
   }
 }
@@ -93,23 +171,49 @@ ObjectChanges & Tranzaction::createObject(ObjType t, ObjectStorage & s)
   if (ObjTypeUnchanged == t || ObjTypeDeleted == t)
     throw ErrorCode(1277);
 
+  this->changes();
   ObjectChanges * changes = new ObjectChanges(t, s);
   changes_.push_back(changes);
   return *changes;
 }
 
+ObjectChanges * Tranzaction::findChanges(const LongName & n)
+{
+  if (changes_.size() < IndexMinSize)
+  {
+    auto it = find_if(changes_.begin(), changes_.end(),
+                      [&](const ObjectChanges * ch) { return ch->objName() == n; });
+    return it != changes_.end() ? *it : nullptr;
+  }
+
+  for (; indexed_ < changes_.size(); indexed_++)
+    index_.emplace(changes_[indexed_]->objName(), changes_[indexed_]);
+  auto it = index_.find(n);
+  return it != index_.end() ? it->second : nullptr;
+}
+
 ObjectChanges & Tranzaction::changeObject(const LongName & n)
 {
-  auto it = find_if(changes_.begin(), changes_.end(),
-                    [&](const ObjectChanges * ch) { return ch->objName() == n; });
-  if (it != changes_.end())
-    return **it;
+  this->changes();
+  if (ObjectChanges * changes = findChanges(n))
+    return *changes;
 
   ObjectChanges * changes = new ObjectChanges(n);
   changes_.push_back(changes);
   return *changes;
 }
 
+void Tranzaction::sortByDepth()
+{
+  changes();
+  stable_sort(changes_.begin(), changes_.end(), [](const ObjectChanges * c0, const ObjectChanges * c1)
+    {
+      return c0->objName().size() < c1->objName().size();
+    });
+  index_.clear();
+  indexed_ = 0;
+}
+
 ObjectChanges & Tranzaction::changeObject(UnifiedObject & o)
 {
   return changeObject(o.LName());
@@ -122,6 +226,141 @@ ObjectChanges & Tranzaction::changeObject(ObjName n)
   return changeObject(ln);
 }
 
+ChangesFilter::ChangesFilter(TrzFilter filter)
+: flags_(filter == TrzFilter::DocInfo ? DOCINFO : filter == TrzFilter::Strings ? STRINGS : filter == TrzFilter::Symbols ? SYMBOLS : 0)
+{
+  ASSERT(filter != TrzFilter::All);
+}
+
+bool ChangesFilter::accept(const LongName & name, ObjType type)
+{
+  if (name.empty())
+    return false;
+  if (name.size() == 1 && type != ObjTypeUnchanged && type != ObjTypeDeleted)
+    topTypes_[name.front()] = type;
+
+  auto it = topTypes_.find(name.front());
+  return it != topTypes_.end() && (UnifiedObject::objDefs_.get(it->second).flags_ & flags_);
+}
+
+// Snapshot is serialized as a map entry: created time is the key
+TrzSnapshot::TrzSnapshot(Reader & r)
+{
+  created_ = r.getInt<datetime_t>();
+  r.getArray(2);
+  r.getVector(disabled_);
+  CborMemWriter w;
+  r.copy(w);
+  state_ = w.data();
+}
+
+void TrzSnapshot::write(Writer & w) const
+{
+  w.putInt(created_);
+  w.putArray(2);
+  w.putVector(disabled_);
+  CborMemReader r(state_);
+  r.copy(w);
+}
+
+ObjectChanges * TrzUndo::changes(const UnifiedObject & obj)
+{
+  if (!valid_)
+    return nullptr;
+
+  // Objects of inserted documents are changed by their own tranzactions
+  for (ObjectStorage * s = &obj.storage(); UnifiedObject * owner = s->isObject(); s = &owner->storage())
+    if (s->isDocument())
+    {
+      invalidate();
+      return nullptr;
+    }
+
+  const LongName & name = obj.LName();
+  auto it = changes_.find(name);
+  if (it == changes_.end())
+    it = changes_.emplace(name, make_unique<ObjectChanges>(name)).first;
+  return it->second.get();
+}
+
+static bool isKept(const ObjectChanges & chgs, PropType pt)
+{
+  return chgs.findProp(pt) || find(chgs.del().begin(), chgs.del().end(), pt) != chgs.del().end();
+}
+
+// Only the value before the tranzaction is kept, the tranzaction may change a property several times
+void TrzUndo::keepProp(const UnifiedObject & obj, PropType pt, PropPtr previous)
+{
+  if (pt == DocIdProp::typeId_)
+    return invalidate();
+
+  ObjectChanges * chgs = changes(obj);
+  if (!chgs || chgs->objType() == ObjTypeDeleted || isKept(*chgs, pt))
+    return;
+
+  if (previous)
+    chgs->prop(previous);
+  else if (Property::propDefs_.get(pt).deletable())
+    chgs->remove(pt);
+  else
+    invalidate();
+}
+
+void TrzUndo::keepDeleted(const UnifiedObject & obj)
+{
+  if (obj.findProp<DocIdProp>())
+    return invalidate();
+
+  ObjectChanges * chgs = changes(obj);
+  if (!chgs || chgs->objType() == ObjTypeDeleted)
+    return;
+
+  chgs->recreate(obj.type());
+  for (const PropPtr& p : obj.props())
+    if (!isKept(*chgs, p->type()))
+      chgs->prop(p);
+}
+
+void TrzUndo::keepCreated(const UnifiedObject & obj)
+{
+  if (valid_ && changes_.count(obj.LName()))
+    return invalidate();
+
+  if (ObjectChanges * chgs = changes(obj))
+    chgs->remove();
+}
+
+// Deleted objects are created before properties are restored because properties may link to them,
+// created objects are deleted last, children before parents.
+void TrzUndo::revert(ObjectStorage & storage) const
+{
+  ASSERT(valid_ == true);
+
+  for (const auto& it : changes_)
+  {
+    const ObjectChanges & chgs = *it.second;
+    if (chgs.objType() != ObjTypeUnchanged && chgs.objType() != ObjTypeDeleted)
+      if (ObjectStorage * s = storage.findStorageOf(chgs.objName()))
+        s->create(chgs.objType(), chgs.objName().back());
+  }
+
+  for (const auto& it : changes_)
+  {
+    const ObjectChanges & chgs = *it.second;
+    if (chgs.objType() != ObjTypeDeleted)
+      if (UnifiedObject * obj = storage.findObject(chgs.objName()))
+        obj->change(chgs);
+  }
+
+  for (auto it = changes_.rbegin(); it != changes_.rend(); ++it)
+  {
+    const ObjectChanges & chgs = *it->second;
+    if (chgs.objType() == ObjTypeDeleted)
+      if (UnifiedObject * obj = storage.findObject(chgs.objName()))
+        obj->changeRemove();
+  }
+}
+
 void Tranzaction::makeCorrect()
 {
 
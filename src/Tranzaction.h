@@ -12,13 +12,42 @@ struct TrzEnabler
 };
 
 
+enum class TrzFilter
+{
+  DocInfo,   
+  Strings,   
+  Symbols,   
+  All        
+};
+
+
+// Selects changes of objects of the TrzFilter class while tranzactions are read in history order.
+// The class is defined by OBJ_FLAGS of the top level object type.
+class ChangesFilter
+{
+public:
+  explicit ChangesFilter(TrzFilter);
+
+  bool accept(const LongName&, ObjType);
+
+private:
+  const int flags_;
+  map<ObjName, ObjType> topTypes_;
+};
+
+
 class Tranzaction
 {
 public:
 
   Tranzaction(const LongName & source = LongName());
 
-  Tranzaction(Reader&);
+  // Only changes accepted by the filter are read if it isn't null.
+  // CBOR is decoded by the code instantiated for CborReader, other formats by virtual calls.
+  Tranzaction(Reader&, ChangesFilter* filter = nullptr);
+
+  // Read only created time and source, changes are decoded from the data on the first access
+  Tranzaction(CborMemReader&, const shared_ptr<const vector<uint8_t>>& data);
 
   void write(Writer&) const;
 
@@ -36,7 +65,24 @@ public:
   ObjectChanges & changeObject(ObjName);
 
 
-  vector<ObjectChanges*> changes_;
+  // Decodes a lazily loaded tranzaction on the first call, so it isn't thread-safe until decoded()
+  inline const vector<ObjectChanges*> & changes() const
+  {
+    if (lazy_)
+      decode();
+    return changes_;
+  }
+
+  // Changes of storages go before changes of their nested objects, the order of others is kept
+  void sortByDepth();
+
+  inline bool decoded() const { return !lazy_; }
+
+  // False if the tranzaction surely doesn't change document variants, checked without decoding
+  inline bool mayChangeVariants(bool deleting) const
+  {
+    return !lazy_ || lazy_->variantProps_ || (deleting && lazy_->deleted_);
+  }
 
 
   inline const LongName & source() const { return source_; }
@@ -56,6 +102,29 @@ private:
 
   datetime_t created_;
 
+  mutable vector<ObjectChanges*> changes_;
+
+  // Changes by object name, built when the count of changes reaches IndexMinSize. It covers changes_
+  // up to indexed_, changes added later are indexed by the next lookup. Reordering of changes_ drops it.
+  static constexpr size_t IndexMinSize = 16;
+  unordered_map<LongName, ObjectChanges*, LongNameHash> index_;
+  size_t indexed_ = 0;
+  ObjectChanges * findChanges(const LongName&);
+
+  // Serialized tranzaction which is not decoded yet
+  struct LazyBody
+  {
+    shared_ptr<const vector<uint8_t>> data_;
+    size_t begin_;
+    size_t end_;
+    bool variantProps_ = false; // DocVariantProp is changed
+    bool deleted_ = false;      // some object is deleted
+  };
+  mutable unique_ptr<LazyBody> lazy_;
+
+  template <ReaderType R> void read(R&, ChangesFilter*);
+  void decode() const;
+
   void makeCorrect();
 
   Tranzaction(const Tranzaction&) = delete;
@@ -65,7 +134,57 @@ private:
 using TrzPtr = shared_ptr<Tranzaction>;
 
 
+// Materialized state of a document after applying all enabled tranzactions up to created_.
+// Used to rebuild the document without replaying the whole history.
+struct TrzSnapshot
+{
+  datetime_t created_ = 0;
+
+  // Tranzactions disabled by document variants when the snapshot was taken
+  vector<datetime_t> disabled_;
+
+  // Objects tree, see ObjectStorage::writeState()
+  vector<uint8_t> state_;
+
+  TrzSnapshot() = default;
+  TrzSnapshot(Reader&);
+  void write(Writer&) const;
+};
+
+using SnapshotPtr = shared_ptr<const TrzSnapshot>;
+
+
+// Inverse changes of an applied tranzaction, collected by UnifiedObject::change() and changeRemove().
+// Reverting restores previous property values, deleted objects and removes created objects,
+// so undo doesn't need to rebuild the whole document.
+class TrzUndo
+{
+public:
+  TrzUndo() = default;
+
+  void keepProp(const UnifiedObject&, PropType, PropPtr previous); // previous is null for added property
+  void keepDeleted(const UnifiedObject&);
+  void keepCreated(const UnifiedObject&);
+
+  // Changes which cannot be reverted, the document has to be rebuilt
+  inline void invalidate() { valid_ = false; changes_.clear(); }
+  inline bool valid() const { return valid_; }
+
+  void revert(ObjectStorage&) const;
+
+private:
+  ObjectChanges * changes(const UnifiedObject&);
+
+  map<LongName, unique_ptr<ObjectChanges>> changes_;
+  bool valid_ = true;
+
+  TrzUndo(const TrzUndo&) = delete;
+  void operator=(const TrzUndo&) = delete;
+};
+
+
 class TrzHub;
+struct DocumentInfo;
 class TrzIO
 {
 public:
@@ -77,7 +196,16 @@ public:
 
   virtual void notify(TrzPtr) = 0;
 
-  inline TrzHub * hub() { return hub_; }
+  // Write materialized state for TrzSnapshot, return false if it is not supported
+  virtual bool snapshot(Writer&) const { return false; }
+
+  // Tranzactions were merged by TrzHub::packHistory(), the document state is the same
+  virtual void historyPacked() {}
+
+  // Fill title and tags of the document, return false if it is not supported
+  virtual bool documentInfo(DocumentInfo&) const { return false; }
+
+  inline TrzHub * hub() const { return hub_; }
 
   virtual ~TrzIO();
 private:
@@ -86,14 +214,6 @@ private:
 };
 
 
-enum class TrzFilter
-{
-  DocInfo,   
-  Strings,   
-  Symbols,   
-  All        
-};
-
 
 
 
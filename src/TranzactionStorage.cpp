@@ -1,11 +1,17 @@
 ﻿
+#include <thread>
+
 #include "TranzactionStorage.h"
+#include "DocumentStorage.h"
 #include "Serialize.h"
 
 
 bool TrzHub::updateDocumentVariants(TrzPtr trz)
 {
-  for (ObjectChanges * ch : trz->changes_)
+  if (!trz->mayChangeVariants(!variants_.empty()))
+    return false; // don't decode lazily loaded tranzaction
+
+  for (ObjectChanges * ch : trz->changes())
   {
     if (ch->objType() == ObjTypeDeleted)
       for (TrzEnabler* te : variants_)
@@ -17,7 +23,7 @@ bool TrzHub::updateDocumentVariants(TrzPtr trz)
   }
 
   bool needRecreate = false;
-  for (ObjectChanges * ch : trz->changes_)
+  for (ObjectChanges * ch : trz->changes())
   {
     for (PropPtr p : ch->props())
       if (p->type() == DocVariantProp::typeId_)
@@ -143,14 +149,17 @@ void TrzHub::notify(TrzPtr trz)
     {
       while (!trzs_.empty() && current_ != trzs_.back()->created())
         trzs_.erase(trzs_.end() - 1);
+      dropSnapshots(current_ + 1);
 
       trzs_.push_back(trz);
       current_ = trz->created();
     }
     else
     {
-
+      dropSnapshots(current_);
     }
+
+    takeSnapshot();
   }
   catch (const std::exception&) 
   {
@@ -248,6 +257,14 @@ datetime_t TrzHub::latest() const
   return trzs_.back()->created();
 }
 
+bool TrzHub::documentInfo(DocumentInfo & info) const
+{
+  for (TrzIO * linked : links_)
+    if (linked->documentInfo(info))
+      return true;
+  return false;
+}
+
 void TrzHub::packHistory(size_t maxCount)
 {
   if (!hasRedo() && !trzs_.empty())
@@ -263,81 +280,658 @@ void TrzHub::packHistory(size_t maxCount)
       trzs_.erase(trzs_.begin() + 1);
     }
     current_ = trzs_.back()->created();
+    snapshots_.clear();
+
+    for (TrzIO * linked : links_)
+      linked->historyPacked();
+  }
+}
+
+vector<TrzPtr>::const_iterator TrzHub::findTranzaction(datetime_t time) const
+{
+  auto it = lower_bound(trzs_.begin(), trzs_.end(), time,
+    [](const TrzPtr & trz, datetime_t t) { return trz->created() < t; });
+  if (it != trzs_.end() && (*it)->created() != time)
+    return trzs_.end();
+  return it;
+}
+
+void TrzHub::takeSnapshot()
+{
+  if (!snapshotInterval_ || trzs_.empty() || current_ != trzs_.back()->created())
+    return;
+
+  size_t count = trzs_.size(); 
+  if (!snapshots_.empty())
+  {
+    auto it = findTranzaction(snapshots_.back()->created_);
+    if (it != trzs_.end())
+      count = trzs_.end() - it - 1;
+  }
+  if (count < snapshotInterval_)
+    return;
+
+  for (TrzIO * linked : links_)
+  {
+    CborMemWriter w;
+    if (linked->snapshot(w))
+    {
+      auto s = make_shared<TrzSnapshot>();
+      s->created_ = current_;
+      for (TrzPtr trz : trzs_)
+        if (!trz->enabled())
+          s->disabled_.push_back(trz->created());
+      s->state_ = w.data();
+      snapshots_.push_back(s);
+      pruneSnapshots();
+      return;
+    }
+  }
+}
+
+// The oldest and the latest snapshots are kept. Of the others, the one leaving the smallest gap of
+// tranzactions relative to its distance from the latest snapshot is dropped, so gaps grow geometrically.
+void TrzHub::pruneSnapshots()
+{
+  while (snapshots_.size() > MaxSnapshots)
+  {
+    vector<size_t> pos;
+    for (const SnapshotPtr & s : snapshots_)
+      pos.push_back(findTranzaction(s->created_) - trzs_.begin());
+
+    size_t drop = 1;
+    double best = numeric_limits<double>::max();
+    for (size_t i = 1; i + 1 < pos.size(); i++)
+    {
+      const double gap = double(pos[i + 1] - pos[i - 1]) / (pos.back() - pos[i + 1] + 1);
+      if (gap < best)
+      {
+        best = gap;
+        drop = i;
+      }
+    }
+    snapshots_.erase(snapshots_.begin() + drop);
   }
 }
 
+void TrzHub::dropSnapshots(datetime_t from)
+{
+  while (!snapshots_.empty() && snapshots_.back()->created_ >= from)
+    snapshots_.pop_back();
+}
+
+void TrzHub::addSnapshot(SnapshotPtr snapshot)
+{
+  auto it = lower_bound(snapshots_.begin(), snapshots_.end(), snapshot->created_,
+    [](const SnapshotPtr & s, datetime_t t) { return s->created_ < t; });
+  if (it != snapshots_.end() && (*it)->created_ == snapshot->created_)
+    *it = snapshot;
+  else
+    snapshots_.insert(it, snapshot);
+}
+
+SnapshotPtr TrzHub::snapshot(datetime_t time) const
+{
+  for (auto sit = snapshots_.rbegin(); sit != snapshots_.rend(); ++sit)
+  {
+    const TrzSnapshot & s = **sit;
+    if (s.created_ > time)
+      continue;
+
+    auto end = findTranzaction(s.created_);
+    if (end == trzs_.end())
+      continue;
+    ++end;
+
+    // document variants must disable the same tranzactions
+    auto disabled = s.disabled_.begin();
+    bool valid = true;
+    for (auto it = trzs_.begin(); it != end && valid; ++it)
+      if (!(*it)->enabled())
+        valid = disabled != s.disabled_.end() && *(disabled++) == (*it)->created();
+    if (valid && disabled == s.disabled_.end())
+      return *sit;
+  }
+  return nullptr;
+}
+
+
+// Add tranzaction to the history the same way as TrzHub::notify() does:
+// re-applied tranzaction replaces the old one, new tranzaction drops redo tail.
+template <class T, class CreatedFn>
+static void addToHistory(vector<T> & trzs, datetime_t & current, const T & trz, CreatedFn created)
+{
+  const datetime_t time = created(trz);
+  for (auto it = trzs.rbegin(); it != trzs.rend() && created(*it) >= time; ++it)
+    if (created(*it) == time)
+    {
+      *it = trz;
+      return;
+    }
+
+  while (!trzs.empty() && created(trzs.back()) > current)
+    trzs.pop_back();
+  trzs.push_back(trz);
+  current = time;
+}
+
+
+void TranzactionStorage::setAppendLog(size_t compactLimit)
+{
+  compactLimit_ = compactLimit;
+}
 
 void TranzactionStorage::setTranzactions(DocId, const vector<TrzPtr> & trzs, datetime_t current)
 {
-  Writer & writer = *createWriter();
-  writer.putArray(trzs.size() + 3);  
-  writer.putInt(SerializationFormatVersion);   
-  writer.putInt(current);            
-  writer.putMap(0); 
+  if (trzFilter_ != TrzFilter::All)
+    return; // partially loaded history must not replace the stored one
+
+  if (!appendLog() || needCompact_ || appended_ >= compactLimit_ || !isLogged(trzs))
+  {
+    writeAll(trzs, current);
+    saved(trzs.empty() ? 0 : trzs.back()->created(), false);
+    return;
+  }
+
+  unique_ptr<Writer> writer(createAppender());
+  appendSnapshots(*writer);
+  if (logged_.size() < trzs.size() && !logged_.empty() && loggedCurrent_ != logged_.back())
+  {
+    writer->putInt(logged_.back()); // new tranzactions must not drop the stored ones
+    writer->putChecksum();
+    loggedCurrent_ = logged_.back();
+    appended_++;
+  }
+  for (size_t i = logged_.size(); i < trzs.size(); i++)
+    append(*writer, trzs[i]);
+  if (loggedCurrent_ != current)
+  {
+    writer->putInt(current);
+    writer->putChecksum();
+    loggedCurrent_ = current;
+    appended_++;
+  }
+  writer->flush();
+  writer.reset();
+  saved(trzs.empty() ? 0 : trzs.back()->created(), false);
+}
+
+void TranzactionStorage::writeAll(const vector<TrzPtr> & trzs, datetime_t current)
+{
+  unique_ptr<Writer> writer(createWriter());
+  writer->putArray(trzs.size() + 3);  
+  writer->putInt(SerializationFormatVersion);   
+  writer->putInt(current);            
+
+  loggedSnapshot_ = 0;
+  if (hub())
+  {
+    writer->putMap(hub()->snapshots().size());
+    for (SnapshotPtr s : hub()->snapshots())
+    {
+      s->write(*writer);
+      loggedSnapshot_ = s->created_;
+    }
+  }
+  else
+    writer->putMap(0); 
+
+  for (TrzPtr t : trzs)
+    writeRecord(*writer, t);
+  writer->putChecksum();
+  writer->flush();
+  writer.reset();
+  commitWriter();
+
+  logged_.clear();
+  logged_.reserve(trzs.size());
   for (TrzPtr t : trzs)
-    t->write(writer);
-  delete &writer;
+    logged_.push_back(t->created());
+  loggedCurrent_ = current;
+  appended_ = 0;
+  needCompact_ = false;
+}
+
+void TranzactionStorage::writeRecord(Writer & writer, TrzPtr trz)
+{
+  writer.beginRecord(trz->created());
+  trz->write(writer);
+  writer.endRecord();
+}
+
+void TranzactionStorage::append(Writer & writer, TrzPtr trz)
+{
+  writeRecord(writer, trz);
+  writer.putChecksum();
+  addToHistory(logged_, loggedCurrent_, trz->created(), [](datetime_t t) { return t; });
+  appended_++;
+}
+
+void TranzactionStorage::appendSnapshots(Writer & writer)
+{
+  if (hub())
+    for (SnapshotPtr s : hub()->snapshots())
+      if (s->created_ > loggedSnapshot_)
+      {
+        writer.putMap(1);
+        s->write(writer);
+        writer.putChecksum();
+        loggedSnapshot_ = s->created_;
+        appended_++;
+      }
+}
+
+bool TranzactionStorage::isLogged(const vector<TrzPtr> & trzs) const
+{
+  if (logged_.size() > trzs.size())
+    return false;
+  for (size_t i = 0; i < logged_.size(); i++)
+    if (logged_[i] != trzs[i]->created())
+      return false;
+  return true;
 }
 
 bool TranzactionStorage::connecting(DocId docId, vector<TrzPtr> & trzs, datetime_t & current)
 {
+  vector<TrzPtr> loaded;
+  vector<SnapshotPtr> snapshots;
+  datetime_t loadedCurrent = current;
+  bool baseLoaded = false;
+
+  // Partially loaded document cannot use snapshots of the whole document
+  unique_ptr<ChangesFilter> filter(trzFilter_ != TrzFilter::All ? new ChangesFilter(trzFilter_) : nullptr);
+  const auto readSnapshot = [&](Reader & r) -> SnapshotPtr
+  {
+    if (filter)
+    {
+      r.skip();
+      r.skip();
+      return nullptr;
+    }
+    return SnapshotPtr(new TrzSnapshot(r));
+  };
+
   try
   {
     unique_ptr<Reader> reader(createReader());
+    if (reader->atEnd())
+      throw ErrorCode(SerializationFileOpenError); // new document
     size_t count = reader->getArray();
-    trzs.reserve(count - 3);
+    loaded.reserve(count - 3);
     
-    if (SerializationFormatVersion != reader->getInt()) 
+    // Older versions are read and rewritten by the next saving, records are never appended to them
+    const int version = reader->getInt();
+    if (version > SerializationFormatVersion)
+      throw ErrorCode(SerializationFormatError);
+    const auto readRecord = [&](Reader & r)
     {
+      if (version >= 2)
+        r.getRecord();
+      return TrzPtr(readTranzaction(r, filter.get()));
+    };
+
+    loadedCurrent = reader->getInt<datetime_t>(); 
+    for (size_t count = reader->getMap(); count > 0; count--)
+      if (SnapshotPtr s = readSnapshot(*reader))
+        snapshots.push_back(s);
+    if (version >= 2)
+      readRecords(*reader, count - 3, filter.get(), loaded);
+    else
+      for (size_t i = 3; i < count; i++)
+        loaded.push_back(readRecord(*reader));
+    reader->checkChecksum();
+    baseLoaded = true;
+    needCompact_ = version != SerializationFormatVersion;
+
+    // Records appended in the append-only log mode, every record is applied after its checksum is verified
+    appended_ = 0;
+    while (!reader->atEnd())
+    {
+      if (reader->isInt())
+      {
+        const datetime_t time = reader->getInt<datetime_t>();
+        reader->checkChecksum();
+        loadedCurrent = time;
+      }
+      else if (reader->isMap())
+      {
+        vector<SnapshotPtr> added;
+        for (size_t count = reader->getMap(); count > 0; count--)
+          if (SnapshotPtr s = readSnapshot(*reader))
+            added.push_back(s);
+        reader->checkChecksum();
+        snapshots.insert(snapshots.end(), added.begin(), added.end());
+      }
+      else
+      {
+        TrzPtr trz = readRecord(*reader);
+        reader->checkChecksum();
+        addToHistory(loaded, loadedCurrent, trz, [](const TrzPtr & t) { return t->created(); });
+      }
+      appended_++;
     }
-
-    current = reader->getInt<datetime_t>(); 
-    reader->getMap();
-    for (size_t i = 3; i < count; i++)
-      trzs.emplace_back(new Tranzaction(*reader));
   }
   catch (const ErrorCode& err) 
   {
     switch (err.code_)
     {
+      case SerializationFileOpenError:
+        if (baseLoaded)
+          throw;
+        needCompact_ = true; // new document
+        break;
       case SerializationFormatError:
       case SerializationInternalError:
-      case SerializationFileOpenError:
+      case SerializationChecksumError:
+        if (!baseLoaded)
+          throw;             // the storage is corrupted, don't replace it by an empty history
+        needCompact_ = true; // the last appended record is torn, it is dropped by the next compaction
         break;
       default:
         throw;
     }
   }
 
+  logged_.clear();
+  for (TrzPtr t : loaded)
+    logged_.push_back(t->created());
+  loggedCurrent_ = loadedCurrent;
+
+  loggedSnapshot_ = 0;
+  for (SnapshotPtr s : snapshots)
+  {
+    if (hub())
+      hub()->addSnapshot(s);
+    loggedSnapshot_ = max(loggedSnapshot_, s->created_);
+  }
+
+  trzs.insert(trzs.end(), loaded.begin(), loaded.end());
+  current = loadedCurrent;
   return true;
 }
 
-void TranzactionStorage::notify(TrzPtr)
+void TranzactionStorage::notify(TrzPtr trz)
+{
+  if (trzFilter_ != TrzFilter::All)
+    throw ErrorCode(PartialDocumentChange);
+
+  if (!appendLog())
+    return;
+
+  const bool compact = needCompact_ || appended_ >= compactLimit_;
+  if (compact)
+  {
+    if (!hub())
+      return;
+    writeAll(hub()->tranzactions(), hub()->current());
+  }
+
+  unique_ptr<Writer> writer(createAppender());
+  appendSnapshots(*writer);
+  append(*writer, trz);
+  writer->flush();
+  writer.reset();
+  saved(trz->created(), !compact);
+}
+
+
+
+Tranzaction * TranzactionStorage::readTranzaction(Reader & r, ChangesFilter * filter)
+{
+  return new Tranzaction(r, filter);
+}
+
+void TranzactionStorage::readRecords(Reader & r, size_t count, ChangesFilter * filter, vector<TrzPtr> & trzs)
+{
+  while (count--)
+  {
+    r.getRecord();
+    trzs.emplace_back(readTranzaction(r, filter));
+  }
+}
+
+TrzRecordIndex::TrzRecordIndex(const vector<uint8_t>& data)
 {
+  CborMemReader r(data);
+  const size_t count = r.getArray();
+  if (count < 3 || r.getInt() < 2)
+    throw ErrorCode(SerializationFormatError);
+  current_ = r.getInt<datetime_t>();
+  for (size_t snapshots = r.getMap(); snapshots > 0; snapshots--)
+  {
+    r.skip();
+    r.skip();
+  }
+
+  records_ = locate(r, count - 3);
+  r.checkChecksum();
+  end_ = r.position();
 }
 
+vector<TrzRecordIndex::Record> TrzRecordIndex::locate(CborMemReader & r, size_t count)
+{
+  vector<Record> res;
+  res.reserve(count);
+  while (count--)
+  {
+    const Reader::Record rec = r.getRecord();
+    const size_t begin = r.position();
+    r.skipRecord(rec);
+    res.push_back({ rec.created_, begin, r.position() });
+  }
+  return res;
+}
 
+const TrzRecordIndex::Record * TrzRecordIndex::find(datetime_t created) const
+{
+  auto it = lower_bound(records_.begin(), records_.end(), created,
+    [](const Record & rec, datetime_t time) { return rec.created_ < time; });
+  return it != records_.end() && it->created_ == created ? &*it : nullptr;
+}
 
-LocalDocumentFile::LocalDocumentFile(const filesystem::path& path, TrzFilter filter)
+LocalDocumentFile::LocalDocumentFile(const filesystem::path& path, TrzFilter filter, int flags, LocalDocumentStorage* storage)
 : TranzactionStorage(filter),
-  path_(path)
+  path_(path),
+  sync_(flags & dfSyncWrites),
+  lazy_(flags & dfLazyLoad),
+  storage_(storage),
+  decodeThreads_(thread::hardware_concurrency())
 {
+  if (flags & dfAppendLog)
+    setAppendLog(DefaultCompactLimit);
+  if (storage_)
+    storage_->files_.insert(this);
 }
 
+LocalDocumentFile::~LocalDocumentFile()
+{
+  detach();
+}
+
+void LocalDocumentFile::detach()
+{
+  if (!storage_)
+    return;
+  if (pendingInfo_)
+  {
+    try
+    {
+      updateManifest(*pendingInfo_);
+    }
+    catch (const std::exception&)
+    {
+    }
+    pendingInfo_.reset();
+  }
+  storage_->files_.erase(this);
+  storage_ = nullptr;
+}
+
+// In lazy mode the whole file is loaded to the memory shared by tranzactions until they are decoded,
+// large files are loaded to decode them in parallel
 Reader* LocalDocumentFile::createReader()
 {
-  return new CborFileReader(path_);
+  if (!lazy_ && !parallel())
+    return new CborFileReader(path_);
+
+  shared_ptr<vector<uint8_t>> data(new vector<uint8_t>);
+  {
+    ifstream file(path_, ios_base::in | ios_base::binary);
+    if (!file.is_open())
+      throw ErrorCode(SerializationFileOpenError);
+    data->resize(filesystem::file_size(path_));
+    file.read(reinterpret_cast<char*>(data->data()), data->size());
+    if (size_t(file.gcount()) != data->size() || data->empty())
+      throw ErrorCode(SerializationFileOpenError);
+  }
+  data_ = data;
+  return new CborMemReader(*data);
+}
+
+void LocalDocumentFile::setParallelDecoding(size_t threads, uintmax_t minSize)
+{
+  decodeThreads_ = threads;
+  parallelMinSize_ = minSize;
+}
+
+bool LocalDocumentFile::parallel() const
+{
+  error_code ec;
+  return trzFilter_ == TrzFilter::All && decodeThreads_ > 1 && filesystem::file_size(path_, ec) >= parallelMinSize_ && !ec;
+}
+
+Tranzaction * LocalDocumentFile::readTranzaction(Reader & r, ChangesFilter * filter)
+{
+  if (!lazy_ || !data_ || filter)
+    return TranzactionStorage::readTranzaction(r, filter);
+  return new Tranzaction(static_cast<CborMemReader&>(r), data_);
+}
+
+// Records are located by their headers and split to parts of nearly equal size, every thread decodes
+// its part to the own range of the vector, so the order of tranzactions is kept.
+// readTranzaction() is called by the threads concurrently.
+void LocalDocumentFile::readRecords(Reader & r, size_t count, ChangesFilter * filter, vector<TrzPtr> & trzs)
+{
+  if (lazy_ || !data_ || filter)
+    return TranzactionStorage::readRecords(r, count, filter, trzs);
+
+  const vector<TrzRecordIndex::Record> records = TrzRecordIndex::locate(static_cast<CborMemReader&>(r), count);
+  const size_t first = trzs.size();
+  trzs.resize(first + count);
+  if (!count)
+    return;
+
+  // Part i is records [bounds[i], bounds[i + 1]), every part has at least one record
+  const size_t parts = min(decodeThreads_, count);
+  const size_t dataBegin = records.front().begin_;
+  const size_t dataSize = records.back().end_ - dataBegin;
+  vector<size_t> bounds = { 0 };
+  for (size_t i = 1; i < parts; i++)
+  {
+    const size_t offset = dataBegin + dataSize * i / parts;
+    const size_t bound = lower_bound(records.begin(), records.end(), offset,
+      [](const TrzRecordIndex::Record & rec, size_t value) { return rec.begin_ < value; }) - records.begin();
+    bounds.push_back(clamp(bound, bounds.back() + 1, count - (parts - i)));
+  }
+  bounds.push_back(count);
+
+  exception_ptr error;
+  mutex errorMutex;
+  {
+    // Started threads are joined even if starting of the next one throws
+    struct Threads : vector<thread>
+    {
+      ~Threads()
+      {
+        for (thread & t : *this)
+          t.join();
+      }
+    } threads;
+    threads.reserve(parts);
+    for (size_t part = 0; part < parts; part++)
+      threads.emplace_back([&, begin = bounds[part], end = bounds[part + 1]]()
+      {
+        try
+        {
+          for (size_t i = begin; i < end; i++)
+          {
+            CborMemReader rec(*data_, records[i].begin_, records[i].end_);
+            trzs[first + i].reset(readTranzaction(rec, nullptr));
+          }
+        }
+        catch (...)
+        {
+          lock_guard<mutex> lock(errorMutex);
+          if (!error)
+            error = current_exception();
+        }
+      });
+  }
+  if (error)
+    rethrow_exception(error);
+}
+
+bool LocalDocumentFile::connecting(DocId docId, vector<TrzPtr> & trzs, datetime_t & current)
+{
+  const bool res = TranzactionStorage::connecting(docId, trzs, current);
+  data_.reset();
+  return res;
 }
 
+// The file is written to the temporary file and replaces the document file after the data is on the disk,
+// so the document is not lost if the saving is interrupted
 Writer * LocalDocumentFile::createWriter()
 {
-  return new CborFileWriter(path_);
+  return new CborFileWriter(tempPath(), false, true);
+}
+
+void LocalDocumentFile::commitWriter()
+{
+  filesystem::rename(tempPath(), path_);
+  if (sync_)
+    CborFileWriter::syncDirectory(path_.parent_path());
+}
+
+// Title and tags are taken from the document now, it may be closed before the file
+void LocalDocumentFile::saved(datetime_t latest, bool appended)
+{
+  if (!storage_ || !hub())
+    return;
+  DocumentInfo info;
+  info.docId_ = hub()->id();
+  info.latest_ = latest;
+  hub()->documentInfo(info);
+  if (appended)
+  {
+    pendingInfo_.reset(new DocumentInfo(move(info)));
+    return;
+  }
+  pendingInfo_.reset();
+  updateManifest(info);
+}
+
+void LocalDocumentFile::updateManifest(DocumentInfo & info)
+{
+  info.size_ = filesystem::file_size(path_);
+  storage_->update(info);
+}
+
+filesystem::path LocalDocumentFile::tempPath() const
+{
+  return path_.parent_path() / ("~" + path_.filename().string());
+}
+
+Writer * LocalDocumentFile::createAppender()
+{
+  return new CborFileWriter(path_, true, sync_);
 }
 
 
 
 Reader * InMemoryTrzStorage::createReader()
 {
+  if (data_.empty())
+    throw ErrorCode(SerializationFileOpenError); // nothing is stored yet
   return new MSReader(data_);
 }
 
@@ -347,4 +941,9 @@ Writer * InMemoryTrzStorage::createWriter()
   return new MSWriter(data_);
 }
 
+Writer * InMemoryTrzStorage::createAppender()
+{
+  return new MSWriter(data_);
+}
+
 
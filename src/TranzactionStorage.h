@@ -4,6 +4,16 @@
 
 #include "Tranzaction.h"
 
+// LocalDocumentFile modes
+enum DOC_FILE_FLAGS
+{
+  dfAppendLog = 1, // append changes to the end of file instead of full file rewriting
+  dfSyncWrites = 2, // flush written data to the disk (fsync), not only to the system cache
+  dfLazyLoad = 4,   // decode tranzactions when they are applied, not while opening
+};
+
+class LocalDocumentStorage;
+
 class TranzactionStorage : public TrzIO
 {
 public:
@@ -22,26 +32,120 @@ public:
     ReadWrite, 
     ReadOnly   
   };
-  virtual Access access() const { return Access::Owner; }
+  // Storage opened with a filter other than TrzFilter::All contains a part of the document
+  // and is read only: it doesn't save and rejects new tranzactions.
+  virtual Access access() const { return trzFilter_ == TrzFilter::All ? Access::Owner : Access::ReadOnly; }
+
+  // Append-only log mode: every tranzaction and undo/redo move are added to the end
+  // of storage as a small record, the storage is rewritten (compacted) only when the
+  // history was changed in other way or after compactLimit appended records.
+  void setAppendLog(size_t compactLimit);
+  inline bool appendLog() const { return compactLimit_ > 0; }
+  inline size_t appendedCount() const { return appended_; }
 
 protected:
 
   [[nodiscard]] virtual Reader * createReader() = 0;  
   [[nodiscard]] virtual Writer * createWriter() = 0;
+  // Writer to add records to the end of storage
+  [[nodiscard]] virtual Writer * createAppender() { throw ErrorCode(NotImplemented); }
+  // Data written by createWriter() writer is complete and replaces the storage content
+  virtual void commitWriter() {}
+  // Read tranzaction from the reader created by createReader()
+  virtual Tranzaction * readTranzaction(Reader&, ChangesFilter*);
+  // Read count of tranzaction records of the base array to the end of the vector
+  virtual void readRecords(Reader&, size_t count, ChangesFilter*, vector<TrzPtr>&);
+  // Storage content was written, latest is the creation time of the newest stored tranzaction.
+  // appended is true when notify() only appended the tranzaction to the log.
+  virtual void saved(datetime_t /*latest*/, bool /*appended*/) {}
 
   const TrzFilter trzFilter_;
 
   datetime_t saved_ = 0;
+
+private:
+  void writeAll(const vector<TrzPtr> & trzs, datetime_t current);
+  void writeRecord(Writer&, TrzPtr);
+  void append(Writer&, TrzPtr);
+  void appendSnapshots(Writer&);
+  bool isLogged(const vector<TrzPtr> & trzs) const;
+
+  size_t compactLimit_ = 0;
+  size_t appended_ = 0;
+  bool needCompact_ = true;
+
+  // Creation time of the stored tranzactions and current time as they will be read back
+  vector<datetime_t> logged_;
+  datetime_t loggedCurrent_ = 0;
+  datetime_t loggedSnapshot_ = 0;
+};
+
+// Tranzaction records of the base array of stored CBOR data, located by their headers without decoding
+// the tranzactions. They are sorted by creation time, so a tranzaction is found by binary search.
+struct TrzRecordIndex
+{
+  struct Record
+  {
+    datetime_t created_;
+    size_t begin_; // offsets of the tranzaction in the data
+    size_t end_;
+  };
+  vector<Record> records_;
+  datetime_t current_ = 0;
+  size_t end_ = 0; // offset after the base array, appended records follow it
+
+  // Throw SerializationFormatError if the data has no record lengths
+  explicit TrzRecordIndex(const vector<uint8_t>& data);
+
+  // Locate count of records from the current position of the reader
+  static vector<Record> locate(CborMemReader&, size_t count);
+
+  // Record of the tranzaction created at the time, nullptr if there is no such one
+  const Record * find(datetime_t created) const;
 };
 
 class LocalDocumentFile : public TranzactionStorage
 {
 public:
-  LocalDocumentFile(const filesystem::path&, TrzFilter);
+  // Document manifest of the storage is updated after saving if it isn't null
+  LocalDocumentFile(const filesystem::path&, TrzFilter, int flags = 0, LocalDocumentStorage* storage = nullptr);
+  ~LocalDocumentFile();
+  bool connecting(DocId docId, vector<TrzPtr>&, datetime_t & current) override;
   [[nodiscard]] Reader* createReader() override;
   [[nodiscard]] Writer* createWriter() override;
+  [[nodiscard]] Writer* createAppender() override;
+  void commitWriter() override;
+  Tranzaction * readTranzaction(Reader&, ChangesFilter*) override;
+  void readRecords(Reader&, size_t count, ChangesFilter*, vector<TrzPtr>&) override;
+  void saved(datetime_t latest, bool appended) override;
+
+  static constexpr size_t DefaultCompactLimit = 1000;
+
+  // Files of at least minSize are read to the memory and their tranzactions are decoded by the count of
+  // threads, by default the count of hardware threads. readTranzaction() is called by the threads concurrently.
+  static constexpr uintmax_t ParallelMinSize = 1 << 20;
+  void setParallelDecoding(size_t threads, uintmax_t minSize = ParallelMinSize);
 protected:
   const filesystem::path path_;
+  const bool sync_;
+  const bool lazy_;
+  LocalDocumentStorage * storage_;
+
+  // File content while connecting in lazy mode or with parallel decoding
+  shared_ptr<const vector<uint8_t>> data_;
+  size_t decodeThreads_;
+  uintmax_t parallelMinSize_ = ParallelMinSize;
+  bool parallel() const;
+
+  filesystem::path tempPath() const;
+
+  // Appended tranzactions update the manifest by the next full write, save or closing of the file
+  unique_ptr<DocumentInfo> pendingInfo_;
+  void updateManifest(DocumentInfo&);
+
+  // Called when the storage is destroyed before the file
+  friend class LocalDocumentStorage;
+  void detach();
 };
 
 class InMemoryTrzStorage : public TranzactionStorage
@@ -49,6 +153,7 @@ class InMemoryTrzStorage : public TranzactionStorage
 public:
   [[nodiscard]] Reader* createReader() override;
   [[nodiscard]] Writer* createWriter() override;
+  [[nodiscard]] Writer* createAppender() override;
 protected:
   MSDataT data_;
 };
@@ -85,11 +190,30 @@ public:
   datetime_t latest() const; 
   datetime_t current() const { return current_; }
 
+  // Title and tags from the linked document
+  bool documentInfo(DocumentInfo&) const;
+
   inline size_t trzCount() const { return trzs_.size(); }
   inline size_t linkCount() const { return links_.size(); }
 
+  inline const vector<TrzPtr>& tranzactions() const { return trzs_; }
+
   void packHistory(size_t maxCount);
 
+  // Document state is materialized every snapshotInterval tranzactions,
+  // undo/redo and opening replay tranzactions from the nearest snapshot only.
+  inline void setSnapshotInterval(size_t count) { snapshotInterval_ = count; }
+  inline const vector<SnapshotPtr>& snapshots() const { return snapshots_; }
+  void addSnapshot(SnapshotPtr);
+
+  // The latest snapshot taken not later than the time and valid for current document variants
+  SnapshotPtr snapshot(datetime_t time) const;
+
+  static constexpr size_t DefaultSnapshotInterval = 100;
+
+  // Snapshots kept by the hub, the latest ones are kept dense and older ones sparse
+  static constexpr size_t MaxSnapshots = 8;
+
   static TrzHub* opened(DocId);
 
 private:
@@ -110,6 +234,13 @@ private:
 
   vector<TrzEnabler*> variants_;
 
+  vector<SnapshotPtr> snapshots_;
+  size_t snapshotInterval_ = DefaultSnapshotInterval;
+  void takeSnapshot();
+  void dropSnapshots(datetime_t from);
+  void pruneSnapshots();
+  vector<TrzPtr>::const_iterator findTranzaction(datetime_t) const;
+
   void inline clearVariants()
   {
     for (TrzEnabler* te : variants_)
@@ -9,6 +9,9 @@ using TestPropInt1 = PropValueTemplate<551, int>;
 using TestPropInt2 = PropValueTemplate<552, int>;
 using TestPropInt3 = PropValueTemplate<553, int>;
 using TestPropLink = PropValueTemplate<554, LinkToObject>;
+using TestPropLinkNoDelete = PropValueTemplate<555, LinkToObject>;
+using TestPropSearch = PropValueTemplate<556, int>;
+using TestPropSearchLink = PropValueTemplate<557, LinkToObject>;
 using TestPropIntReadOnly = PropValueTemplate<997, int>;
 using TestPropIntNoDelete = PropValueTemplate<996, int>;
 
@@ -51,6 +54,16 @@ protected:
   void onChange(uint16_t flags) override { counter_++; lastChanges_ = flags; }
 };
 
+// UnifiedObject isn't the first base
+class TestObjectStorage3 : public ObjectStorage, public UnifiedObjectTempl<554>
+{
+public:
+  ObjectStorage * isStorage() const override { return const_cast<TestObjectStorage3*>(this); }
+  UnifiedObject * isObject() const override { return const_cast<TestObjectStorage3*>(this); }
+protected:
+  void onChange(uint16_t) override {}
+};
+
 class TestObjectStorage2 : public UnifiedObjectTempl<552>, public ObjectStorage
 {
 public:
@@ -91,15 +104,19 @@ int main(int argc, char** argv)
   Property::addPropertyDefinition<TestPropInt2>("TestPropInt2", 0);
   Property::addPropertyDefinition<TestPropInt3>("TestPropInt3", 0);
   Property::addPropertyDefinition<TestPropLink>("TestPropLink", 0);
+  Property::addPropertyDefinition<TestPropLinkNoDelete>("TestPropLinkNoDelete", NO_DELETE);
+  Property::addPropertyDefinition<TestPropSearch>("TestPropSearch", SEARCHABLE);
+  Property::addPropertyDefinition<TestPropSearchLink>("TestPropSearchLink", SEARCHABLE);
   Property::addPropertyDefinition<TestPropIntReadOnly>("TestPropIntReadOnly", READONLY);
   Property::addPropertyDefinition<TestPropIntNoDelete>("TestPropIntNoDelete", NO_DELETE);
   Property::addPropertyDefinition<TreeFolderProp>("TreeFolderProp", 0);
 
-  UnifiedObject::addObjectDefinition<TestTopObject>("TestTopObject", TOPOBJECT);
+  UnifiedObject::addObjectDefinition<TestTopObject>("TestTopObject", TOPOBJECT | DOCINFO);
   UnifiedObject::addObjectDefinition<TestObject1>("TestObject1", 0);
-  UnifiedObject::addObjectDefinition<TestObject2>("TestObject2", 0);
-  UnifiedObject::addObjectDefinition<TestObjectStorage1>("TestObjectStorage1", 0);
+  UnifiedObject::addObjectDefinition<TestObject2>("TestObject2", STRINGS);
+  UnifiedObject::addObjectDefinition<TestObjectStorage1>("TestObjectStorage1", STRINGS);
   UnifiedObject::addObjectDefinition<TestObjectStorage2>("TestObjectStorage2", 0);
+  UnifiedObject::addObjectDefinition<TestObjectStorage3>("TestObjectStorage3", 0);
   UnifiedObject::addObjectDefinition<TestInsertedDocument>("TestInsertedDocument", 0);
 
   testing::InitGoogleTest(&argc, argv);
@@ -118,6 +135,11 @@ TEST(Property, StandartTypes)
   EXPECT_THROW(Property::addPropertyDefinition<TestPropInt1>("userId", 0), std::exception);
 
   EXPECT_EQ(UnifiedObject::objDefs_.get(UserProfile::typeId_).name_, "user");
+  EXPECT_EQ(UnifiedObject::objDefs_.findByName("user")->id_, UserProfile::typeId_);
+  EXPECT_EQ(Property::propDefs_.findByName("docId")->id_, DocIdProp::typeId_);
+  EXPECT_EQ(Property::propDefs_.findByName("none"), nullptr);
+  EXPECT_THROW(Property::propDefs_.get(100000), std::exception);
+  EXPECT_THROW(Property::propDefs_.get(-1), std::exception);
   EXPECT_THROW(UnifiedObject::addObjectDefinition<TopDocumentObject>("objName", 0), std::exception);
   EXPECT_THROW(UnifiedObject::addObjectDefinition<TopDocumentObject>("user", 0), std::exception);
 }
@@ -234,6 +256,19 @@ TEST(Property, Edit)
     EXPECT_EQ(topObj->findProp<TestPropInt2>()->value(), 301);
     EXPECT_EQ(topObj->lastChanges_, osChgProp);
   }
+
+  { 
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt3(3)).prop(new TestPropInt1(1));
+    doc.notify(trz);
+
+    ASSERT_EQ(topObj->propertyCount(), 3);
+    EXPECT_EQ(topObj->findProp<TestPropInt1>()->value(), 1);
+    EXPECT_EQ(topObj->findProp<TestPropInt2>()->value(), 301);
+    EXPECT_EQ(topObj->findProp<TestPropInt3>()->value(), 3);
+    EXPECT_EQ(topObj->findProp(TestPropLink::typeId_), nullptr);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1,552:301,553:3]");
+  }
 }
 
 TEST(Property, Restrictions)
@@ -516,6 +551,7 @@ TEST(PropertyLink, ThreeObjects)
   TestObject2* obj3 = doc.findObject<TestObject2>();
   EXPECT_TRUE(obj1 && obj2 && obj3);
 
+  EXPECT_EQ(doc.initializedCount(), 3);
   {
     TrzPtr trz(new Tranzaction());  
     trz->changeObject(1).prop(new TestPropInt1(10));
@@ -528,6 +564,7 @@ TEST(PropertyLink, ThreeObjects)
   EXPECT_EQ(obj1->lastChanges_, osAddProp);       
   EXPECT_EQ(obj2->lastChanges_, osParentChanged); 
   EXPECT_EQ(obj3->lastChanges_, 0); 
+  EXPECT_EQ(doc.initializedCount(), 5); // only the changed object and the linked one
 
   {
     TrzPtr trz(new Tranzaction());  
@@ -545,14 +582,130 @@ TEST(PropertyLink, ThreeObjects)
   EXPECT_FALSE(obj2->isActive());
   EXPECT_TRUE(obj3->isActive());
 }
-/*
+
+TEST(PropertyLink, CascadeDelete)
+{
+  TrzHub hub(21);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    trz->createObject(TestObject1::typeId_, doc).prop(new TestPropLinkNoDelete(0, { 1 }));
+    trz->createObject(TestObject1::typeId_, doc).prop(new TestPropLinkNoDelete(0, { 2 }));
+    trz->createObject(TestObject2::typeId_, doc).prop(new TestPropLink(0, { 2 }));
+    trz->createObject(TestObject2::typeId_, doc).prop(new TestPropInt1(5)).prop(new TestPropLink(0, { 3 }));
+    hub.notify(trz);
+  }
+  const string initial = doc.debugString();
+  EXPECT_STREQ(initial.c_str(), "500#1[]501#2[555:[0,1]]501#3[555:[0,2]]502#4[554:[0,2]]502#5[551:5,554:[0,3]]");
+
+  // Objects linked by not deletable properties are deleted too, others lose the links
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).remove();
+    hub.notify(trz);
+  }
+  EXPECT_STREQ(doc.debugString().c_str(), "502#4[]502#5[551:5]");
+  EXPECT_EQ(doc.findObject<TestObject2>()->lastChanges_, osParentDeleted | osDelProp);
+
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), initial.c_str());
+  EXPECT_EQ(doc.findObjectByName(1)->linked().end_ - doc.findObjectByName(1)->linked().begin_, 1);
+}
+
+TEST(PropertyLink, EpochOfDocument)
+{
+  TopObjectStorage doc1;
+  TopObjectStorage doc2;
+  for (TopObjectStorage * doc : { &doc1, &doc2 })
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, *doc);
+    trz->createObject(TestObjectStorage1::typeId_, *doc);
+    doc->notify(trz);
+  }
+  ObjectStorage & storage = *doc1.findObjectByName(2)->isStorage();
+  const uint64_t epoch = doc1.linksEpoch();
+  EXPECT_NE(epoch, doc2.linksEpoch());
+  EXPECT_EQ(storage.linksEpoch(), epoch);
+
+  // Objects of another document don't change the epoch, objects of nested storages do
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestObject1::typeId_, doc2);
+    doc2.notify(trz);
+  }
+  EXPECT_EQ(doc1.linksEpoch(), epoch);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestObject1::typeId_, storage);
+    doc1.notify(trz);
+  }
+  EXPECT_NE(doc1.linksEpoch(), epoch);
+  EXPECT_EQ(storage.linksEpoch(), doc1.linksEpoch());
+  EXPECT_EQ(storage.findObjectByName(1)->linksEpoch(), doc1.linksEpoch());
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST(PropertyLink, DISABLED_CascadeDeleteBenchmark)
+{
+  const int count = 100000;
+  TopObjectStorage doc;
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < count; i++)
+      trz->createObject(TestObject1::typeId_, doc).prop(i % 2 ? (Property*)new TestPropLink(0, { 1 }) : new TestPropLinkNoDelete(0, { 1 }));
+    doc.notify(trz);
+  }
+
+  TrzPtr trz(new Tranzaction());
+  trz->changeObject(1).remove();
+  const auto start = chrono::steady_clock::now();
+  doc.notify(trz);
+  const chrono::duration<double> time = chrono::steady_clock::now() - start;
+  EXPECT_EQ(doc.size(false), count / 2);
+  cout << "Delete of object with " << count << " linking objects " << time.count() * 1000 << " ms" << endl;
+}
+
+TEST(PropertyLink, InitOnlyChanged)
+{
+  TopObjectStorage doc;
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < 100; i++)
+      trz->createObject(TestObject1::typeId_, doc);
+    ObjectChanges & chgs = trz->createObject(TestObjectStorage1::typeId_, doc);
+    doc.notify(trz);
+    trz.reset(new Tranzaction());
+    trz->createObject(TestObject2::typeId_, *doc.findObjectByName(chgs.objName().back())->isStorage());
+    doc.notify(trz);
+  }
+  EXPECT_EQ(doc.initializedCount(), 103);
+
+  // Objects of nested storages are initialized too
+  TestObjectStorage1 * storage = doc.findObject<TestObjectStorage1>();
+  TestObject2 * nested = storage->findObject<TestObject2>();
+  EXPECT_EQ(nested->initCount(), 1);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(*nested).prop(new TestPropInt1(1));
+    doc.notify(trz);
+  }
+  EXPECT_EQ(nested->initCount(), 2);
+  EXPECT_EQ(nested->lastChanges_, osAddProp);
+  EXPECT_EQ(doc.initializedCount(), 104);
+}
+
 TEST(PropertyLink, EnumerateObject)
 {
   TopObjectStorage doc;
   auto countLink = [&](PropType pt) 
   {
     size_t count = 0;
-    for (auto * obj : doc.findObject<TestTopObject>()->linked(pt)) { count ++; }
+    for ([[maybe_unused]] auto * obj : doc.findObject<TestTopObject>()->linked(pt)) { count ++; }
     return count;
   };
 
@@ -588,8 +741,39 @@ TEST(PropertyLink, EnumerateObject)
     EXPECT_EQ(obj2->findProp<TreeFolderProp>()->object<UnifiedObject>(obj2), obj1);
   }
 
+  // Many links to one object
+  {
+    TrzPtr trz(new Tranzaction());
+    for (int i = 0; i < 5000; i++)
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropLink(0, { 1 }));
+    doc.notify(trz);
+    EXPECT_EQ(countLink(TestPropLink::typeId_), 5000);
+    EXPECT_EQ(countLink(TreeFolderProp::typeId_), 1);
+    EXPECT_EQ(countLink(0), 5001);
+
+    // Linking objects are ordered by names, not by addresses
+    ObjName prev = 0;
+    for (const UnifiedObject * obj : doc.findObject<TestTopObject>()->linked(TestPropLink::typeId_))
+    {
+      EXPECT_GT(obj->name(), prev);
+      prev = obj->name();
+    }
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    for (ObjName name = 10; name < 5000; name += 2)
+      trz->changeObject(name).remove(TestPropLink::typeId_);
+    doc.notify(trz);
+    EXPECT_EQ(countLink(TestPropLink::typeId_), 2505);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).remove();
+    doc.notify(trz);
+    EXPECT_EQ(doc.size(false), 5003);
+    EXPECT_FALSE(doc.findObjectByName(20)->findProp<TestPropLink>());
+  }
 }
-*/
 
 TEST(TopObjectStorage, Id)
 {
@@ -606,6 +790,352 @@ TEST(TopObjectStorage, Id)
 
 
 
+TEST(TopObjectStorage, ObjectsIterator)
+{
+  TopObjectStorage doc;
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    trz->createObject(TestObjectStorage1::typeId_, doc);
+    trz->createObject(TestObject1::typeId_, doc);
+    trz->createObject(TestObjectStorage1::typeId_, doc);
+    doc.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    ObjectStorage & storage2 = *doc.findObjectByName(2)->isStorage();
+    trz->createObject(TestObject2::typeId_, storage2);
+    trz->createObject(TestObject2::typeId_, storage2);
+    trz->createObject(TestObject2::typeId_, storage2).prop(new TestPropInt1(1));
+    doc.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject({ 2, 2 }).remove();
+    doc.notify(trz);
+  }
+
+  string names;
+  const auto range = doc.objects(true);
+  for (auto it = range.begin(); it != range.end(); ++it)
+    names += to_string(it.depth()) + ":" + to_string((*it).name()) + " ";
+  EXPECT_EQ(names, "0:1 0:2 1:1 1:2 1:3 0:3 0:4 ");
+
+  EXPECT_EQ(doc.size(false), 4);
+  EXPECT_EQ(doc.size(true), 6);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[]551#2[502#1[]502#3[551:1]]501#3[]551#4[]");
+
+  size_t count = 0;
+  for (const auto & part : range.split(3))
+    for (UnifiedObject & obj : part)
+      count += obj.isActive();
+  EXPECT_EQ(count, 6);
+  EXPECT_EQ(range.split(10).size(), 4);
+}
+
+TEST(TopObjectStorage, Compaction)
+{
+  TrzHub hub(22);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < 3000; i++)
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(i));
+    hub.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    for (ObjName name = 2; name < 1000; name++)
+      trz->changeObject(name).remove();
+    hub.notify(trz);
+  }
+  // Less than a half of objects is deleted
+  EXPECT_EQ(doc.objects().size(), 3001);
+  EXPECT_EQ(doc.deletedCount(), 998);
+  EXPECT_EQ(doc.reclaimedBytes(), 0);
+  const size_t capacity = doc.objectsCapacity();
+  EXPECT_GT(capacity, 3001 * sizeof(UnifiedObject));
+  {
+    TrzPtr trz(new Tranzaction());
+    for (ObjName name = 1000; name < 2000; name++)
+      trz->changeObject(name).remove();
+    hub.notify(trz);
+  }
+  EXPECT_EQ(doc.objects().size(), 1003);
+  EXPECT_EQ(doc.deletedCount(), 0);
+  EXPECT_GT(doc.reclaimedBytes(), 1998 * (sizeof(PropPtr) + sizeof(UnifiedObject*)));
+  EXPECT_LT(doc.reclaimedBytes(), 1998 * sizeof(UnifiedObject));
+  EXPECT_EQ(doc.size(false), 1003);
+
+  // Names of freed objects aren't reused, undo creates them again in the freed memory
+  EXPECT_EQ(doc.nextName(), 3002);
+  hub.undoRedo(-1);
+  EXPECT_EQ(doc.size(false), 2003);
+  EXPECT_EQ(doc.objectsCapacity(), capacity);
+  EXPECT_STREQ(doc.findObjectByName(1500)->debugString().c_str(), "551:1498");
+  hub.undoRedo(1);
+  EXPECT_EQ(doc.size(false), 1003);
+  EXPECT_EQ(doc.deletedCount(), 1000);
+
+  // Packing history frees all deleted objects
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(2500).remove();
+    hub.notify(trz);
+  }
+  EXPECT_EQ(doc.deletedCount(), 1001);
+  hub.packHistory(1);
+  EXPECT_EQ(doc.deletedCount(), 0);
+  EXPECT_EQ(doc.objects().size(), 1002);
+  hub.undoRedo(0);
+  EXPECT_EQ(doc.size(false), 1002);
+  EXPECT_EQ(doc.objectsCapacity(), capacity);
+}
+
+TEST(TopObjectStorage, Arena)
+{
+  // Freed objects are reused whatever the offset of UnifiedObject in them is
+  TrzHub hub(27);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  const auto createStorages = [&]()
+  {
+    TrzPtr trz(new Tranzaction());
+    for (int i = 0; i < 1500; i++)
+      trz->createObject(TestObjectStorage3::typeId_, doc);
+    hub.notify(trz);
+    return trz;
+  };
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    hub.notify(trz);
+  }
+  TrzPtr created = createStorages();
+  const size_t capacity = doc.objectsCapacity();
+  {
+    TrzPtr trz(new Tranzaction());
+    for (const ObjectChanges * chgs : created->changes())
+      trz->changeObject(chgs->objName()).remove();
+    hub.notify(trz);
+  }
+  EXPECT_EQ(doc.objects().size(), 1);
+  createStorages();
+  EXPECT_EQ(doc.size(false), 1501);
+  EXPECT_EQ(doc.objectsCapacity(), capacity);
+
+  // A storage created apart from a document has its own arena
+  InvitedUser storage;
+  storage.create(TestObject1::typeId_, 1);
+  storage.create(TestObjectStorage3::typeId_, 2)->isStorage()->create(TestObject2::typeId_, 1);
+  EXPECT_STREQ(storage.ObjectStorage::debugString().c_str(), "501#1[]554#2[502#1[]]");
+
+  // Rebuild keeps only a few blocks
+  for (int i = 0; i < 5; i++)
+    createStorages();
+  for (size_t i = 0; i < TopObjectStorage::MaxUndoDepth; i++)
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt1(int(i)));
+    hub.notify(trz);
+  }
+  EXPECT_GT(doc.objectsCapacity(), ObjectArena::KeptBlocks * ObjectArena::BlockSize);
+  hub.undoRedo(1 - int(hub.tranzactions().size()));
+  EXPECT_EQ(doc.size(false), 1);
+  EXPECT_EQ(doc.objectsCapacity(), ObjectArena::KeptBlocks * ObjectArena::BlockSize);
+}
+
+// A failed tranzaction rebuilds the document waiting for compaction, undo deeper than MaxUndoDepth
+// rebuilds it again, later tranzactions compact it still
+TEST(TopObjectStorage, CompactionAfterRebuild)
+{
+  TrzHub hub(26);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < 3000; i++)
+      trz->createObject(TestObject1::typeId_, doc);
+    trz->changeObject(3001).prop(new TestPropIntReadOnly(1));
+    hub.notify(trz);
+  }
+  for (int i = 0; i < int(TopObjectStorage::MaxUndoDepth) + 1; i++)
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt1(i));
+    hub.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    for (ObjName name = 2; name < 2000; name++)
+      trz->changeObject(name).remove();
+    trz->changeObject(3001).prop(new TestPropIntReadOnly(2));
+    EXPECT_THROW(hub.notify(trz), exception);
+  }
+  EXPECT_EQ(doc.size(false), 3001);
+
+  hub.undoRedo(-int(TopObjectStorage::MaxUndoDepth) - 1);
+  EXPECT_STREQ(doc.findObjectByName(1)->debugString().c_str(), "");
+  {
+    TrzPtr trz(new Tranzaction());
+    for (ObjName name = 2; name < 2000; name++)
+      trz->changeObject(name).remove();
+    hub.notify(trz);
+  }
+  EXPECT_EQ(doc.size(false), 1003);
+  EXPECT_EQ(doc.deletedCount(), 0);
+  EXPECT_EQ(doc.objects().size(), 1003);
+}
+
+TEST(TopObjectStorage, DISABLED_RebuildBenchmark)
+{
+  const int trzCount = 150;
+  const int count = 2000;
+  TrzHub hub(25);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  for (int i = 0; i < trzCount; i++)
+  {
+    TrzPtr trz(new Tranzaction());
+    if (!i)
+      trz->createObject(TestTopObject::typeId_, doc);
+    for (int j = 0; j < count; j++)
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(j));
+    hub.notify(trz);
+  }
+
+  // Undo deeper than MaxUndoDepth rebuilds the document, the objects are allocated in the same memory again
+  const size_t capacity = doc.objectsCapacity();
+  const auto start = chrono::steady_clock::now();
+  for (int i = 0; i < 10; i++)
+  {
+    hub.undoRedo(-int(TopObjectStorage::MaxUndoDepth) - 1);
+    hub.undoRedo(int(TopObjectStorage::MaxUndoDepth) + 1);
+  }
+  const chrono::duration<double> time = chrono::steady_clock::now() - start;
+  EXPECT_EQ(doc.size(false), trzCount * count + 1);
+  EXPECT_EQ(doc.objectsCapacity(), capacity);
+  cout << "Rebuild of document with " << trzCount * count << " objects " << time.count() * 100 << " ms" << endl;
+}
+
+TEST(TopObjectStorage, TypeIndex)
+{
+  TrzHub hub(23);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < 6; i++)
+      trz->createObject(i % 2 ? TestObject1::typeId_ : TestObject2::typeId_, doc);
+    hub.notify(trz);
+  }
+  const auto names = [&](ObjType type)
+  {
+    string res;
+    for (const UnifiedObject * obj : doc.objectsOfType(type))
+      res += to_string(obj->name());
+    return res;
+  };
+  EXPECT_EQ(names(TestObject1::typeId_), "357");
+  EXPECT_EQ(names(TestObject2::typeId_), "246");
+  EXPECT_EQ(names(TestObjectStorage1::typeId_), "");
+  EXPECT_EQ(doc.findObject<TestObject1>()->name(), 3);
+
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(3).remove();
+    trz->changeObject(6).remove();
+    hub.notify(trz);
+  }
+  EXPECT_EQ(names(TestObject1::typeId_), "57");
+  EXPECT_EQ(names(TestObject2::typeId_), "24");
+  EXPECT_EQ(doc.findObject<TestObject1>()->name(), 5);
+
+  hub.undoRedo(-1);
+  EXPECT_EQ(names(TestObject1::typeId_), "357");
+  EXPECT_EQ(names(TestObject2::typeId_), "246");
+  EXPECT_EQ(doc.findObject<TestObject1>()->name(), 3);
+
+  // Deleted objects are still in the index when they are created again by undo
+  hub.undoRedo(1);
+  hub.undoRedo(-1);
+  EXPECT_EQ(names(TestObject1::typeId_), "357");
+  EXPECT_EQ(names(TestObject2::typeId_), "246");
+}
+
+TEST(TopObjectStorage, PropIndex)
+{
+  TrzHub hub(24);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    trz->createObject(TestObjectStorage1::typeId_, doc);
+    hub.notify(trz);
+  }
+  ObjectStorage & storage = *doc.findObjectByName(2)->isStorage();
+  const auto names = [&](const auto & objects)
+  {
+    set<string> res;
+    for (const UnifiedObject * obj : objects)
+      res.insert((&obj->storage() == &doc ? "d" : "s") + to_string(obj->name()));
+    string str;
+    for (const string & name : res)
+      str += name;
+    return str;
+  };
+  {
+    TrzPtr trz(new Tranzaction());
+    for (int i = 0; i < 6; i++)
+      trz->createObject(TestObject1::typeId_, i % 2 ? storage : doc).prop(new TestPropSearch(i % 3)).prop(new TestPropInt1(i % 3));
+    hub.notify(trz);
+  }
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(0))), "d3s2");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(2))), "d4s3");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(3))), "");
+  EXPECT_EQ(names(doc.find(TestPropInt1::typeId_, int64_t(0))), "");
+  EXPECT_EQ(names(doc.findRange(TestPropSearch::typeId_, int64_t(1), int64_t(3))), "d4d5s1s3");
+
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(3).prop(new TestPropSearch(2));
+    trz->changeObject(4).remove(TestPropSearch::typeId_);
+    trz->changeObject(5).remove();
+    trz->changeObject(*storage.findObjectByName(1)).prop(new TestPropSearch(0));
+    hub.notify(trz);
+  }
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(0))), "s1s2");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(1))), "");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(2))), "d3s3");
+
+  hub.undoRedo(-1);
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(0))), "d3s2");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(1))), "d5s1");
+  EXPECT_EQ(names(doc.find(TestPropSearch::typeId_, int64_t(2))), "d4s3");
+  EXPECT_EQ(names(doc.findRange(TestPropSearch::typeId_, int64_t(0), int64_t(2))), "d3d5s1s2");
+
+  // Objects having the same value are ordered by long names, ranges by the value first
+  EXPECT_EQ(doc.find(TestPropSearch::typeId_, int64_t(0)), vector<UnifiedObject*>({ storage.findObjectByName(2), doc.findObjectByName(3) }));
+  EXPECT_EQ(doc.findRange(TestPropSearch::typeId_, int64_t(1), int64_t(3)), vector<UnifiedObject*>({ storage.findObjectByName(1),
+    doc.findObjectByName(5), storage.findObjectByName(3), doc.findObjectByName(4) }));
+
+  // Values without their own key are found by equality only
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(3).prop(new TestPropSearchLink(0, { 4 }));
+    hub.notify(trz);
+  }
+  const Property * link = doc.findObjectByName(3)->findProp(TestPropSearchLink::typeId_);
+  EXPECT_EQ(names(doc.find(TestPropSearchLink::typeId_, link->key())), "d3");
+  EXPECT_THROW(doc.findRange(TestPropSearchLink::typeId_, int64_t(0), int64_t(10)), ErrorCode);
+  EXPECT_THROW(doc.findRange(TestPropSearch::typeId_, link->key(), link->key()), ErrorCode);
+}
+
 TEST(TrzHub, Connect)
 {
   TrzHub hub(11111);
@@ -895,14 +1425,84 @@ TEST(Tranzaction, ReApply)
   }
 }
 
-TEST(Tranzaction, Merge)
+TEST(Tranzaction, UndoIncremental)
 {
+  TrzHub hub(11111);
+  TopObjectStorage doc;
+  hub.connect(&doc);
 
-  auto check = [](TrzPtr t0, TrzPtr t1, const char * expectedResult)
   {
-    TopObjectStorage doc0;
-    doc0.notify(t0);
-    doc0.notify(t1);
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt1(1));
+    trz->createObject(TestObject1::typeId_, doc).prop(new TreeFolderProp(0, { 1 }));
+    trz->createObject(TestObject2::typeId_, doc).prop(new TestPropInt1(7));
+    hub.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt1(2)).prop(new TestPropInt2(5));
+    hub.notify(trz);
+  }
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).remove();
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "501#2[]502#3[551:7]");
+  }
+
+  TestObject1* obj2 = doc.findObject<TestObject1>();
+  TestObject2* obj3 = doc.findObject<TestObject2>();
+  const size_t obj3Count = obj3->initCount();
+
+  // Deleted object and the property removed by the cascade are restored, untouched objects are not reinitialized
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:2,552:5]501#2[99:[0,1]]502#3[551:7]");
+  EXPECT_EQ(doc.findObject<TestObject1>(), obj2);
+  EXPECT_EQ(obj2->lastChanges_, osAddProp);
+  EXPECT_EQ(obj3->initCount(), obj3Count);
+
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1]501#2[99:[0,1]]502#3[551:7]");
+  EXPECT_EQ(obj3->initCount(), obj3Count);
+
+  hub.undoRedo(2);
+  EXPECT_STREQ(doc.debugString().c_str(), "501#2[]502#3[551:7]");
+  EXPECT_EQ(doc.findObject<TestObject2>(), obj3);
+
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestObject1::typeId_, doc).prop(new TestPropLink(0, { 3 }));
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "501#2[]502#3[551:7]501#4[554:[0,3]]");
+  }
+
+  // Created object is deleted again, so deleting of the linked object doesn't touch it
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), "501#2[]502#3[551:7]");
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(3).remove();
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "501#2[]");
+  }
+
+  // The same state after rebuilding the document from the history
+  TopObjectStorage doc2;
+  hub.connect(&doc2);
+  EXPECT_STREQ(doc2.debugString().c_str(), "501#2[]");
+  hub.undoRedo(-2);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:2,552:5]501#2[99:[0,1]]502#3[551:7]");
+  EXPECT_STREQ(doc2.debugString().c_str(), "500#1[551:2,552:5]501#2[99:[0,1]]502#3[551:7]");
+}
+
+TEST(Tranzaction, Merge)
+{
+
+  auto check = [](TrzPtr t0, TrzPtr t1, const char * expectedResult)
+  {
+    TopObjectStorage doc0;
+    doc0.notify(t0);
+    doc0.notify(t1);
 
     TopObjectStorage doc1;
     t0->merge(t1);
@@ -976,6 +1576,27 @@ TEST(Tranzaction, Merge)
     }
     check(trz1, trz2, "500#1[551:11,552:22]");
   }
+
+  { // enough changes to look objects up by the index
+    TrzPtr trz1(new Tranzaction());
+    TrzPtr trz2(new Tranzaction());
+    for (ObjName name = 1; name <= 40; name++)
+      trz1->changeObject(LongName{ 2, name }).prop(new TestPropInt1(1));
+    for (ObjName name = 21; name <= 60; name++)
+      trz2->changeObject(LongName{ 2, name }).prop(new TestPropInt2(2));
+    EXPECT_EQ(&trz1->changeObject(LongName{ 2, 40 }), trz1->changes()[39]);
+    trz1->merge(trz2);
+    EXPECT_EQ(trz1->changes().size(), 60);
+    EXPECT_EQ(trz1->changeObject(LongName{ 2, 30 }).props().size(), 2);
+    EXPECT_EQ(trz1->changeObject(LongName{ 2, 50 }).props().size(), 1);
+    EXPECT_EQ(trz1->changes().size(), 60);
+
+    // Reordered changes are indexed again
+    trz1->changeObject(1);
+    trz1->sortByDepth();
+    EXPECT_EQ(&trz1->changeObject(1), trz1->changes()[0]);
+    EXPECT_EQ(trz1->changes().size(), 61);
+  }
 }
 
 TEST(Tranzaction, Serialize)
@@ -1021,9 +1642,75 @@ TEST(Tranzaction, Serialize)
 
     EXPECT_STREQ(applySerialized(trz).c_str(), "500#1[552:22,553:32]502#3[553:33,554:[0,1]]");
   }
+
+  { // damaged lazy tranzaction stays not decoded
+    Tranzaction trz;
+    trz.changeObject(1).prop(new TestPropInt1(1));
+    trz.changeObject(2).prop(new TestPropInt2(2));
+    CborMemWriter w;
+    trz.write(w);
+    shared_ptr<vector<uint8_t>> data(new vector<uint8_t>(w.data()));
+    const vector<uint8_t> propType = { 0x19, 0x02, 0x28 }; // TestPropInt2::typeId_
+    auto it = find_end(data->begin(), data->end(), propType.begin(), propType.end());
+    ASSERT_TRUE(it != data->end());
+    it[1] = 0x7F; // unknown property type
+
+    CborMemReader r(*data);
+    Tranzaction lazy(r, data);
+    EXPECT_THROW(lazy.changes(), exception);
+    EXPECT_FALSE(lazy.decoded());
+    EXPECT_THROW(lazy.changes(), exception);
+
+    // Changing a lazy tranzaction decodes it first
+    CborMemReader r2(w.data());
+    Tranzaction lazy2(r2, make_shared<vector<uint8_t>>(w.data()));
+    lazy2.changeObject(2).prop(new TestPropInt3(3));
+    EXPECT_TRUE(lazy2.decoded());
+    ASSERT_EQ(lazy2.changes().size(), 2);
+    EXPECT_EQ(lazy2.changes()[1]->props().size(), 2);
+  }
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST(Tranzaction, DISABLED_DeserializeBenchmark)
+{
+  TopObjectStorage doc;
+  TrzPtr trz(new Tranzaction());
+  for (int j = 0; j < 100000; j++)
+    trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(j)).prop(new TestPropInt2(j * 1000));
+  CborMemWriter w;
+  trz->write(w);
+
+  const auto start = chrono::steady_clock::now();
+  const int count = 20;
+  for (int i = 0; i < count; i++)
+  {
+    CborMemReader r(w.data());
+    Tranzaction trz2(r);
+    EXPECT_EQ(trz2.changes().size(), 100000);
+  }
+  const chrono::duration<double> time = chrono::steady_clock::now() - start;
+  cout << "Tranzaction(Reader&) " << w.data().size() * count / time.count() / (1 << 20) << " MB/s, "
+    << 100000 * count / time.count() << " changes/s" << endl;
 }
 
 
+TEST(Tranzaction, DISABLED_ChangeObjectBenchmark)
+{
+  for (ObjName count : { 10000, 100000, 1000000 })
+  {
+    const auto start = chrono::steady_clock::now();
+    Tranzaction trz;
+    for (ObjName name = 1; name <= count; name++)
+      trz.changeObject(LongName{ 2, name }).prop(new TestPropInt1(1));
+    for (ObjName name = 1; name <= count; name++)
+      trz.changeObject(LongName{ 2, name }).prop(new TestPropInt2(2));
+    const chrono::duration<double> time = chrono::steady_clock::now() - start;
+    EXPECT_EQ(trz.changes().size(), count);
+    cout << "Tranzaction::changeObject() " << count << " objects " << time.count() * 1000 << " ms" << endl;
+  }
+}
+
 TEST(TrzHub, Serialize)
 {
   InMemoryTrzStorage file;
@@ -1070,6 +1757,233 @@ TEST(TrzHub, Serialize)
   }
 }
 
+TEST(TrzHub, AppendLog)
+{
+  InMemoryTrzStorage file;
+  file.setAppendLog(4);
+
+  {
+    TrzHub hub(11111);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(&file);
+
+    for (int i = 1; i <= 3; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      if (i == 1)
+        trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt2(i));
+      else
+        trz->changeObject(1).prop(new TestPropInt2(i));
+      hub.notify(trz);
+    }
+    EXPECT_EQ(file.appendedCount(), 3);
+
+    hub.undoRedo(-1);
+    EXPECT_EQ(file.appendedCount(), 4); 
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:2]");
+  }
+
+  {
+    TrzHub hub(11111);
+    TopObjectStorage doc;
+    hub.connect(&file);
+    hub.connect(&doc);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:2]");
+    EXPECT_EQ(hub.trzCount(), 3);
+    EXPECT_TRUE(hub.hasRedo());
+
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt2(4));
+    hub.notify(trz);
+    EXPECT_EQ(file.appendedCount(), 1); 
+
+    trz->changeObject(1).prop(new TestPropInt1(5));
+    hub.notify(trz);
+    EXPECT_EQ(file.appendedCount(), 2);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:4,551:5]");
+  }
+
+  {
+    TrzHub hub(11111);
+    TopObjectStorage doc;
+    hub.connect(&file);
+    hub.connect(&doc);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:4,551:5]");
+    EXPECT_EQ(hub.trzCount(), 3);
+    EXPECT_FALSE(hub.hasRedo());
+
+    hub.packHistory(1);
+    hub.save(); 
+    EXPECT_EQ(file.appendedCount(), 0);
+  }
+
+  {
+    TrzHub hub(11111);
+    TopObjectStorage doc;
+    hub.connect(&file);
+    hub.connect(&doc);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:4,551:5]");
+    EXPECT_EQ(hub.trzCount(), 1);
+  }
+}
+
+TEST(TrzHub, Snapshots)
+{
+  InMemoryTrzStorage file;
+  file.setAppendLog(100);
+  const char* states[] = {
+    "500#1[552:1]501#2[554:[0,1]]502#3[]",
+    "500#1[552:2]501#2[554:[0,1]]502#3[]",
+    "500#1[552:2]501#2[554:[0,1]]",
+    "500#1[552:4]501#2[554:[0,1]]",
+    "500#1[552:5]501#2[554:[0,1]]",
+    "500#1[552:6]501#2[554:[0,1]]",
+    "500#1[552:7]501#2[554:[0,1]]" };
+
+  {
+    TrzHub hub(11111);
+    hub.setSnapshotInterval(2);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(&file);
+
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt2(1));
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropLink(0, { 1 }));
+      trz->createObject(TestObject2::typeId_, doc);
+      hub.notify(trz);
+    }
+    for (int i = 2; i <= 7; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      if (i == 3)
+        trz->changeObject(3).remove();
+      else
+        trz->changeObject(1).prop(new TestPropInt2(i));
+      hub.notify(trz);
+      EXPECT_STREQ(doc.debugString().c_str(), states[i - 1]);
+    }
+    EXPECT_EQ(hub.snapshots().size(), 3);
+
+    for (int i = 5; i >= 0; i--)
+    {
+      hub.undoRedo(-1);
+      EXPECT_STREQ(doc.debugString().c_str(), states[i]);
+    }
+    hub.undoRedo(3);
+    EXPECT_STREQ(doc.debugString().c_str(), states[3]);
+  }
+
+  {
+    TrzHub hub(11111);
+    TopObjectStorage doc;
+    hub.connect(&file);
+    hub.connect(&doc);
+    EXPECT_EQ(hub.snapshots().size(), 3);
+    EXPECT_STREQ(doc.debugString().c_str(), states[3]);
+
+    TestTopObject * obj1 = doc.findObject<TestTopObject>();
+    TestObject1 * obj2 = doc.findObject<TestObject1>();
+    ASSERT_TRUE(obj1 && obj2);
+    EXPECT_EQ(obj2->findProp<TestPropLink>()->object(obj2), obj1);
+    EXPECT_EQ(obj1->initCount(), 1);
+
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestObject2::typeId_, doc);
+      hub.notify(trz);
+    }
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[552:4]501#2[554:[0,1]]502#4[]");
+    EXPECT_EQ(hub.snapshots().size(), 2);
+
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).remove();
+      hub.notify(trz);
+    }
+    EXPECT_STREQ(doc.debugString().c_str(), "501#2[]502#4[]");
+  }
+}
+
+TEST(TrzHub, SnapshotsLimit)
+{
+  TrzHub hub(28);
+  hub.setSnapshotInterval(2);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    hub.notify(trz);
+  }
+  for (int i = 0; i < 200; i++)
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt1(i));
+    hub.notify(trz);
+    EXPECT_LE(hub.snapshots().size(), TrzHub::MaxSnapshots);
+  }
+  ASSERT_EQ(hub.snapshots().size(), TrzHub::MaxSnapshots);
+
+  // The latest and the oldest are kept, gaps between snapshots don't shrink to the past
+  const auto position = [&](size_t i)
+  {
+    const datetime_t created = hub.snapshots()[i]->created_;
+    return find_if(hub.tranzactions().begin(), hub.tranzactions().end(),
+      [&](const TrzPtr & trz) { return trz->created() == created; }) - hub.tranzactions().begin();
+  };
+  EXPECT_GE(position(TrzHub::MaxSnapshots - 1), hub.trzCount() - 2);
+  EXPECT_EQ(position(0), 1);
+  for (size_t i = 1; i + 1 < TrzHub::MaxSnapshots; i++)
+    EXPECT_GE(position(i) - position(i - 1), position(i + 1) - position(i));
+
+  hub.undoRedo(-150);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:49]");
+}
+
+TEST(TrzHub, SnapshotsWithVariants)
+{
+  TrzHub hub(11111);
+  hub.setSnapshotInterval(1);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+
+  { 
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt1(1));
+    trz->createObject(TestObject1::typeId_, doc).prop(new DocVariantProp(DocVariantEnum::Enabled));
+    hub.notify(trz);
+  }
+  { 
+    TrzPtr trz(new Tranzaction({2}));
+    trz->changeObject(1).prop(new TestPropInt1(2));
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:2]501#2[155:1]");
+  }
+  { 
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(2).prop(new DocVariantProp(DocVariantEnum::Disabled));
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1]501#2[155:0]");
+  }
+  { 
+    TrzPtr trz(new Tranzaction());
+    trz->changeObject(1).prop(new TestPropInt2(1));
+    hub.notify(trz);
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1,552:1]501#2[155:0]");
+  }
+  EXPECT_EQ(hub.snapshots().size(), 3);
+
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1]501#2[155:0]");
+  hub.undoRedo(-1);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:2]501#2[155:1]");
+  hub.undoRedo(2);
+  EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1,552:1]501#2[155:0]");
+}
+
 TEST(DocumentStorage, Simple)
 {
   const DocId docId = 11111;
@@ -1118,6 +2032,570 @@ TEST(DocumentStorage, Simple)
 
 
 
+TEST(DocumentStorage, AppendLog)
+{
+  const DocId docId = 22222;
+  const string path = PROJECT_DIR "/build/tmp";
+  const auto fileSize = [&]() { return filesystem::file_size(filesystem::path(path) / "56ce"); };
+
+  uintmax_t size1 = 0;
+  { 
+    LocalDocumentStorage lds(path, dfAppendLog);
+    unique_ptr<TranzactionStorage> file(lds.open(docId, TrzFilter::All));
+
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(file.get());
+
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    for (int i = 0; i < 100; i++)
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(i));
+    hub.notify(trz);
+    size1 = fileSize();
+
+    TrzPtr trz2(new Tranzaction());
+    trz2->changeObject(1).prop(new TestPropInt2(1));
+    hub.notify(trz2);
+    EXPECT_LT(fileSize() - size1, 48); // the small tranzaction with its record header
+  }
+
+  { 
+    LocalDocumentStorage lds(path, dfAppendLog);
+    unique_ptr<TranzactionStorage> file(lds.open(docId, TrzFilter::All));
+
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(file.get());
+    EXPECT_EQ(hub.trzCount(), 2);
+    EXPECT_EQ(doc.size(false), 101);
+    EXPECT_EQ(doc.findObject<TestTopObject>()->findProp<TestPropInt2>()->value(), 1);
+  }
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+
+TEST(DocumentStorage, FileReaderBlocks)
+{
+  const filesystem::path file = filesystem::path(PROJECT_DIR "/build/tmp") / "blocks";
+  const string longStr(100, 'x');
+  {
+    CborFileWriter w(file);
+    w.putArray(7);
+    w.putInt(5);
+    w.putInt(-1000);
+    w.putInt(INT64_MAX);
+    w.putStr(longStr);
+    w.putStr("");
+    w.putReal(1.5);
+    w.putNull();
+  }
+
+  // Block boundaries cut headers and strings
+  for (size_t blockSize : { 1, 3, 7, 64 })
+  {
+    CborFileReader r(file, blockSize);
+    EXPECT_EQ(r.getArray(), 7);
+    EXPECT_EQ(r.getInt(), 5);
+    EXPECT_EQ(r.getInt(), -1000);
+    EXPECT_EQ(r.getInt<int64_t>(), INT64_MAX);
+    EXPECT_EQ(r.getStr(), longStr);
+    EXPECT_EQ(r.getStr(), "");
+    EXPECT_EQ(r.getReal(), 1.5);
+    EXPECT_FALSE(r.atEnd());
+    r.getNull();
+    EXPECT_TRUE(r.atEnd());
+    EXPECT_THROW(r.getNull(), exception);
+  }
+
+  filesystem::remove(file);
+  CborFileReader r(file);
+  EXPECT_THROW(r.getArray(), exception);
+}
+
+
+TEST(DocumentStorage, Records)
+{
+  const DocId docId = 88888;
+  const string path = PROJECT_DIR "/build/tmp";
+  const filesystem::path file = filesystem::path(path) / "15b38";
+  const auto readFile = [&]()
+  {
+    vector<uint8_t> data(filesystem::file_size(file));
+    ifstream(file, ios_base::binary).read(reinterpret_cast<char*>(data.data()), data.size());
+    return data;
+  };
+
+  // The document of format version 1 is read and saved in the current format
+  TopObjectStorage dummy;
+  TrzPtr first(new Tranzaction());
+  first->createObject(TestTopObject::typeId_, dummy).prop(new TestPropInt1(1));
+  {
+    CborFileWriter w(file);
+    w.putArray(4);
+    w.putInt(1);
+    w.putInt(first->created());
+    w.putMap(0);
+    first->write(w);
+    w.putChecksum();
+  }
+  EXPECT_THROW(TrzRecordIndex{ readFile() }, exception);
+
+  vector<datetime_t> created;
+  {
+    LocalDocumentStorage lds(path);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1]");
+
+    for (int i = 0; i < 3; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      for (int j = 0; j <= i; j++)
+        trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(j));
+      hub.notify(trz);
+    }
+    hub.save();
+    for (const TrzPtr & trz : hub.tranzactions())
+      created.push_back(trz->created());
+  }
+
+  // Records are found by their headers and decoded separately
+  const vector<uint8_t> data = readFile();
+  TrzRecordIndex index(data);
+  ASSERT_EQ(index.records_.size(), 4);
+  EXPECT_EQ(index.current_, created.back());
+  EXPECT_EQ(index.end_, data.size());
+  for (size_t i = 0; i < created.size(); i++)
+  {
+    const TrzRecordIndex::Record * rec = index.find(created[i]);
+    ASSERT_EQ(rec, &index.records_[i]);
+    CborMemReader r(data, rec->begin_, rec->end_);
+    Tranzaction trz(r);
+    EXPECT_EQ(trz.created(), created[i]);
+    EXPECT_EQ(trz.changes().size(), max<size_t>(i, 1));
+    EXPECT_TRUE(r.atEnd());
+  }
+  EXPECT_EQ(index.find(created.back() + 1), nullptr);
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, ParallelDecoding)
+{
+  const DocId docId = 99999;
+  const string path = PROJECT_DIR "/build/tmp";
+  const filesystem::path file = filesystem::path(path) / "1869f";
+  {
+    LocalDocumentStorage lds(path);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc);
+      hub.notify(trz);
+    }
+    for (int i = 0; i < 50; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      for (int j = 0; j <= i; j++)
+        trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(i)).prop(new TestPropInt2(j));
+      trz->changeObject(1).prop(new TestPropInt1(i));
+      hub.notify(trz);
+    }
+    hub.undoRedo(-2);
+    hub.save();
+  }
+
+  // Threads decode tranzactions by readTranzaction() of the storage
+  struct CountingFile : LocalDocumentFile
+  {
+    using LocalDocumentFile::LocalDocumentFile;
+    atomic<size_t> read_ = 0;
+    Tranzaction * readTranzaction(Reader & r, ChangesFilter * filter) override
+    {
+      read_++;
+      return LocalDocumentFile::readTranzaction(r, filter);
+    }
+  };
+  const auto open = [&](size_t threads)
+  {
+    CountingFile storage(file, TrzFilter::All);
+    storage.setParallelDecoding(threads, 0);
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(&storage);
+    EXPECT_EQ(hub.trzCount(), 51);
+    EXPECT_EQ(storage.read_, 51);
+    return doc.debugString();
+  };
+  const string sequential = open(1);
+  EXPECT_EQ(open(4), sequential);
+  EXPECT_EQ(open(100), sequential);
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, DISABLED_OpenBenchmark)
+{
+  const DocId docId = 99999;
+  const string path = PROJECT_DIR "/build/tmp";
+  const filesystem::path file = filesystem::path(path) / "1869f";
+  {
+    LocalDocumentStorage lds(path);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc);
+      hub.notify(trz);
+    }
+    for (int i = 0; i < 200; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      for (int j = 0; j < 5000; j++)
+        trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(i)).prop(new TestPropInt2(j * 1000));
+      hub.notify(trz);
+    }
+    hub.connect(storage.get());
+    hub.save();
+  }
+
+  for (size_t threads : { size_t(1), size_t(thread::hardware_concurrency()) })
+  {
+    const auto start = chrono::steady_clock::now();
+    vector<TrzPtr> trzs;
+    datetime_t current = 0;
+    LocalDocumentFile storage(file, TrzFilter::All);
+    storage.setParallelDecoding(threads);
+    storage.connecting(docId, trzs, current);
+    const chrono::duration<double> time = chrono::steady_clock::now() - start;
+    EXPECT_EQ(trzs.size(), 201);
+    cout << "Open by " << threads << " threads " << filesystem::file_size(file) / time.count() / (1 << 20) << " MB/s" << endl;
+  }
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, Corruption)
+{
+  const DocId docId = 44444;
+  const string path = PROJECT_DIR "/build/tmp";
+  const filesystem::path file = filesystem::path(path) / "ad9c";
+
+  const auto load = [&](size_t & trzCount)
+  {
+    LocalDocumentStorage lds(path, dfAppendLog);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    trzCount = hub.trzCount();
+    return doc.debugString();
+  };
+
+  {
+    LocalDocumentStorage lds(path, dfAppendLog);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt1(1));
+      hub.notify(trz);
+    }
+    hub.save();
+    EXPECT_TRUE(filesystem::exists(file));
+    EXPECT_FALSE(filesystem::exists(filesystem::path(path) / "~ad9c"));
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TestPropInt1(2));
+      hub.notify(trz);
+    }
+  }
+
+  size_t trzCount = 0;
+  EXPECT_STREQ(load(trzCount).c_str(), "500#1[551:2]");
+  EXPECT_EQ(trzCount, 2);
+
+  // Torn appended record is dropped
+  filesystem::resize_file(file, filesystem::file_size(file) - 2);
+  EXPECT_STREQ(load(trzCount).c_str(), "500#1[551:1]");
+  EXPECT_EQ(trzCount, 1);
+
+  // Corrupted base is not replaced by empty history
+  {
+    fstream f(file, ios_base::in | ios_base::out | ios_base::binary);
+    f.seekg(5);
+    const char c = static_cast<char>(f.get() ^ 1);
+    f.seekp(5);
+    f.put(c);
+  }
+  EXPECT_THROW(load(trzCount), exception);
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, LazyLoad)
+{
+  const DocId docId = 55555;
+  const string path = PROJECT_DIR "/build/tmp";
+  {
+    LocalDocumentStorage lds(path);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    hub.setSnapshotInterval(4);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc);
+      hub.notify(trz);
+    }
+    for (int i = 0; i < 9; i++)
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TestPropInt1(i));
+      hub.notify(trz);
+    }
+    hub.save();
+  }
+
+  for (int pass = 0; pass < 2; pass++)
+  {
+    LocalDocumentStorage lds(path, dfLazyLoad);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:8]");
+
+    // Only tranzactions after the latest snapshot are replayed
+    ASSERT_EQ(hub.trzCount(), 10);
+    EXPECT_FALSE(hub.tranzactions()[7]->decoded());
+    EXPECT_TRUE(hub.tranzactions()[8]->decoded());
+
+    // Saving copies not decoded tranzactions as is
+    hub.save();
+    EXPECT_FALSE(hub.tranzactions()[7]->decoded());
+
+    if (pass == 1)
+    {
+      hub.undoRedo(-3);
+      EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:5]");
+    }
+  }
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, Filter)
+{
+  const DocId docId = 66666;
+  const string path = PROJECT_DIR "/build/tmp";
+  {
+    LocalDocumentStorage lds(path, dfAppendLog);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropInt1(1));
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(2));
+      trz->createObject(TestObjectStorage1::typeId_, doc);
+      hub.notify(trz);
+    }
+    hub.save();
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TestPropInt2(3));
+      ObjectStorage* storage1 = doc.findObject<TestObjectStorage1>()->isStorage();
+      trz->createObject(TestObject2::typeId_, *storage1).prop(new TestPropInt1(4));
+      hub.notify(trz);
+    }
+    EXPECT_STREQ(doc.debugString().c_str(), "500#1[551:1,552:3]501#2[551:2]551#3[502#1[551:4]]");
+  }
+
+  const auto load = [&](TrzFilter filter)
+  {
+    LocalDocumentStorage lds(path);
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, filter));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    if (filter != TrzFilter::All)
+    {
+      EXPECT_EQ(storage->access(), TranzactionStorage::Access::ReadOnly);
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TestPropInt1(5));
+      EXPECT_THROW(hub.notify(trz), exception);
+      hub.save();
+    }
+    return doc.debugString();
+  };
+
+  EXPECT_STREQ(load(TrzFilter::DocInfo).c_str(), "500#1[551:1,552:3]");
+  EXPECT_STREQ(load(TrzFilter::Strings).c_str(), "551#3[502#1[551:4]]");
+  EXPECT_STREQ(load(TrzFilter::Symbols).c_str(), "");
+  EXPECT_STREQ(load(TrzFilter::All).c_str(), "500#1[551:1,552:3]501#2[551:2]551#3[502#1[551:4]]");
+
+  LocalDocumentStorage(path).remove(docId);
+}
+
+TEST(DocumentStorage, Manifest)
+{
+  const DocId docId = 77777;
+  const filesystem::path path = PROJECT_DIR "/build/tmp/docs";
+  filesystem::remove_all(path);
+  filesystem::create_directories(path);
+  {
+    LocalDocumentStorage lds(path, dfAppendLog | dfSyncWrites);
+    EXPECT_TRUE(lds.list().empty());
+    unique_ptr<TranzactionStorage> storage(lds.open(docId, TrzFilter::All));
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    hub.connect(storage.get());
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->createObject(DocStorageInfo::typeId_, doc).prop(new TitleProp("Plan")).prop(new TagsProp("work,,2024"));
+      hub.notify(trz);
+    }
+    hub.save();
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TitleProp("Budget"));
+      hub.notify(trz);
+    }
+
+    // Appended tranzactions don't update the manifest until the document is saved or closed
+    DocumentInfo info;
+    ASSERT_TRUE(lds.documentInfo(docId, info));
+    EXPECT_EQ(info.title_, "Plan");
+    EXPECT_LT(info.latest_, hub.latest());
+
+    hub.save();
+    ASSERT_TRUE(lds.documentInfo(docId, info));
+    EXPECT_EQ(info.title_, "Budget");
+    EXPECT_EQ(info.tags_, vector<string>({ "work", "2024" }));
+    EXPECT_EQ(info.latest_, hub.latest());
+    EXPECT_EQ(info.size_, filesystem::file_size(path / "12fd1"));
+    {
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TitleProp("Costs"));
+      hub.notify(trz);
+    }
+  }
+
+  const auto check = [&](const char* title)
+  {
+    LocalDocumentStorage lds(path);
+    vector<DocumentInfo> docs = lds.documents();
+    ASSERT_EQ(docs.size(), 1);
+    EXPECT_EQ(docs[0].docId_, docId);
+    EXPECT_EQ(docs[0].title_, title);
+    EXPECT_EQ(lds.list(), vector<DocId>({ docId }));
+  };
+  check("Costs");
+
+  // Missing manifest is rebuilt from the documents
+  filesystem::remove(path / "manifest");
+  check("Costs");
+
+  // The file left open after its storage writes the appended changes when the storage is destroyed
+  {
+    unique_ptr<TranzactionStorage> storage;
+    TrzHub hub(docId);
+    TopObjectStorage doc;
+    hub.connect(&doc);
+    {
+      LocalDocumentStorage lds(path, dfAppendLog);
+      storage.reset(lds.open(docId, TrzFilter::All));
+      hub.connect(storage.get());
+      TrzPtr trz(new Tranzaction());
+      trz->changeObject(1).prop(new TitleProp("Taxes"));
+      hub.notify(trz);
+    }
+    check("Taxes");
+  }
+
+  LocalDocumentStorage(path).remove(docId);
+  EXPECT_TRUE(LocalDocumentStorage(path).list().empty());
+
+  // Storages of the same directory see changes of each other
+  {
+    LocalDocumentStorage first(path), second(path);
+    EXPECT_TRUE(first.list().empty());
+    DocumentInfo info;
+    info.docId_ = 2;
+    second.update(info);
+    EXPECT_EQ(first.list(), vector<DocId>({ 2 }));
+    info.docId_ = 3;
+    first.update(info);
+    EXPECT_EQ(second.list(), vector<DocId>({ 2, 3 }));
+  }
+  EXPECT_EQ(LocalDocumentStorage(path).list(), vector<DocId>({ 2, 3 }));
+  filesystem::remove_all(path);
+}
+
+// Run with --gtest_also_run_disabled_tests
+TEST(DocumentStorage, DISABLED_SaveBenchmark)
+{
+  const DocId docId = 33333;
+  const string path = PROJECT_DIR "/build/tmp";
+  LocalDocumentStorage lds(path);
+  unique_ptr<TranzactionStorage> file(lds.open(docId, TrzFilter::All));
+
+  TrzHub hub(docId);
+  TopObjectStorage doc;
+  hub.connect(&doc);
+  {
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc);
+    hub.notify(trz);
+  }
+  for (int i = 0; i < 100; i++)
+  {
+    TrzPtr trz(new Tranzaction());
+    for (int j = 0; j < 2000; j++)
+      trz->createObject(TestObject1::typeId_, doc).prop(new TestPropInt1(i)).prop(new TestPropInt2(j * 1000));
+    hub.notify(trz);
+  }
+  hub.connect(file.get());
+
+  const auto start = chrono::steady_clock::now();
+  const int count = 10;
+  for (int i = 0; i < count; i++)
+    hub.save();
+  const chrono::duration<double> time = chrono::steady_clock::now() - start;
+
+  const auto size = filesystem::file_size(filesystem::path(path) / "8235");
+  cout << "TrzHub::save() " << size * count / time.count() / (1 << 20) << " MB/s, file size " << size << endl;
+
+  lds.remove(docId);
+}
+
+
 TEST(DocumentInserting, Simple)
 {
   TrzHub hub1(11111);
@@ -1446,7 +2924,7 @@ TEST(Property, Serialize)
 
     const auto& pdef = Property::propDefs_.get(prop.type());
     Reader* r = w->getBackReader();
-    Property* prop2 = pdef.creator_(*r);
+    PropPtr prop2 = pdef.creator_(*r);
     delete r;
     delete w;
 
@@ -1456,18 +2934,57 @@ TEST(Property, Serialize)
     EXPECT_FALSE(jw1.data().empty()) << "property \"" << prop.def().name_ << "\" has no debug string";
     prop2->write(jw2);
     EXPECT_STREQ(jw1.data().c_str(), jw2.data().c_str());
-    delete prop2;
   };
 
 
   testFn(UserIdProp(DefaultLocalUserId));
   testFn(UserIdProp(MainUserId));
   testFn(DocIdProp(createDocId(MainUserId, 1000000)));
-
+  testFn(TitleProp("short"));
+  testFn(TitleProp("title longer than an item"));
 
   {
+    // Short strings are stored in the items, long ones in the strings buffer
+    MSDataT data;
+    MSWriter w(data);
+    w.putStr("");
+    w.putStr(string(MSItem::InlineSize, 'a'));
+    w.putStr(string(MSItem::InlineSize + 1, 'b'));
+    w.putInt(-5);
+    w.putReal(0.5);
+    w.putStr(string(1000, 'c'));
+    EXPECT_EQ(data.items_.size(), 6);
+    EXPECT_EQ(data.strings_.size(), MSItem::InlineSize + 1001);
+
+    MSDataT moved = move(data);
+    MSReader r(moved);
+    EXPECT_EQ(r.getStrView(), "");
+    EXPECT_EQ(r.getStrView(), string(MSItem::InlineSize, 'a'));
+    EXPECT_EQ(r.getStr(), string(MSItem::InlineSize + 1, 'b'));
+    EXPECT_EQ(r.getInt(), -5);
+    EXPECT_EQ(r.getReal(), 0.5);
+    EXPECT_EQ(r.getStrView(), string(1000, 'c'));
+    EXPECT_TRUE(r.atEnd());
   }
 
+  {
+    // Record content is skipped by its length in items
+    MSDataT data;
+    MSWriter w(data);
+    w.beginRecord(77);
+    w.putArray(2);
+    w.putStr("skipped");
+    w.putInt(1);
+    w.endRecord();
+    w.putInt(2);
+
+    MSReader r(data);
+    const Reader::Record rec = r.getRecord();
+    EXPECT_EQ(rec.created_, 77);
+    EXPECT_EQ(rec.length_, 3);
+    r.skipRecord(rec);
+    EXPECT_EQ(r.getInt(), 2);
+  }
 }
 
 
@@ -1550,6 +3067,28 @@ TEST(Property, Links)
     EXPECT_STREQ(doc.debugString().c_str(), "500#1[554:[0,999]]");
   }
 
+  { 
+    TopObjectStorage doc;
+    TrzPtr trz(new Tranzaction());
+    trz->createObject(TestTopObject::typeId_, doc).prop(new TestPropLink(0, {2}));
+    doc.notify(trz);
+
+    TestTopObject * obj1 = doc.findObject<TestTopObject>();
+    const TestPropLink * link = obj1->findProp<TestPropLink>();
+    EXPECT_FALSE(link->object(obj1));
+    EXPECT_FALSE(link->object(obj1));
+
+    // Cached object is resolved again after objects are created or deleted
+    trz.reset(new Tranzaction());
+    trz->createObject(TestObject1::typeId_, doc);
+    doc.notify(trz);
+    EXPECT_EQ(link->object(obj1), doc.findObjectByName(2));
+
+    trz.reset(new Tranzaction());
+    trz->changeObject(2).remove();
+    doc.notify(trz);
+    EXPECT_FALSE(link->object(obj1));
+  }
 }
 
 